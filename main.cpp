@@ -21,6 +21,42 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <climits>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <sstream>
+#include <unordered_map>
+#include <deque>
+#include <cinttypes>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
+#include <future>
+#include <unordered_set>
+#include <iomanip>
+#include <system_error>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
 //***************************************************************************************************//
@@ -43,14 +79,14 @@ struct Pixel
  * @param offset the offset at which to read the integer
  * @param bytes  the number of bytes to read
  * @return the integer starting at the given offset
- */ 
+ */
 int get_int(fstream& stream, int offset, int bytes)
 {
     stream.seekg(offset);
     int result = 0;
     int base = 1;
     for (int i = 0; i < bytes; i++)
-    {   
+    {
         result = result + stream.get() * base;
         base = base * 256;
     }
@@ -58,512 +94,7758 @@ int get_int(fstream& stream, int offset, int bytes)
 }
 
 /**
- * Reads the BMP image specified and returns the resulting image as a vector
- * @param filename BMP image filename
- * @return the image as a vector of vector of Pixels
+ * Sets a value to the char array starting at the offset using the size
+ * specified by the bytes.
+ * This is a helper function for write_image()
+ * @param arr    Array to set values for
+ * @param offset Starting index offset
+ * @param bytes  Number of bytes to set
+ * @param value  Value to set
+ * @return nothing
  */
-vector<vector<Pixel>> read_image(string filename)
+void set_bytes(unsigned char arr[], int offset, int bytes, int value)
 {
-    // Open the binary file
-    fstream stream;
-    stream.open(filename, ios::in | ios::binary);
+    for (int i = 0; i < bytes; i++)
+    {
+        arr[offset+i] = (unsigned char)(value>>(i*8));
+    }
+}
 
-    // Get the image properties
-    int file_size = get_int(stream, 2, 4);
-    int start = get_int(stream, 10, 4);
-    int width = get_int(stream, 18, 4);
-    int height = get_int(stream, 22, 4);
-    int bits_per_pixel = get_int(stream, 28, 2);
+//***************************************************************************************************//
+//                                      PARALLEL ROW EXECUTOR                                        //
+//***************************************************************************************************//
 
-    // Scan lines must occupy multiples of four bytes
-    int scanline_size = width * (bits_per_pixel / 8);
-    int padding = 0;
-    if (scanline_size % 4 != 0)
+// Work on a range of rows [begin, end)
+typedef function<void(int begin, int end)> RowRangeBody;
+
+// Most threads a pool or a thread count option may ask for
+const int MAX_THREADS = 256;
+
+// A fixed set of worker threads that split row ranges between them. Each
+// participant starts with an equal share of the rows and takes small chunks
+// from the front of its own share; when that runs out it steals the back half
+// of another participant's share. Every row is handled exactly once by the
+// same code as the serial path, so results never depend on the thread count.
+class ThreadPool
+{
+public:
+    /**
+     * Starts the workers; the calling thread of each job is the last participant
+     * If the system refuses to start a thread, the pool keeps the workers it
+     * did start and its size shrinks to match.
+     * @param threads the number of participants, workers plus the caller
+     */
+    explicit ThreadPool(int threads)
     {
-        padding = 4 - scanline_size % 4;
+        thread_count = max(1, threads);
+        for (int i = 0; i < thread_count - 1; i++)
+        {
+            try
+            {
+                workers.emplace_back([this, i] { worker_loop(i); });
+            }
+            catch (const system_error&)
+            {
+                thread_count = i + 1;
+                break;
+            }
+        }
     }
 
-    // Return empty vector if this is not a valid image
-    if (file_size != start + (scanline_size + padding) * height)
+    ~ThreadPool()
     {
-        return {};
+        {
+            lock_guard<mutex> lock(job_mutex);
+            stopping = true;
+        }
+        job_ready.notify_all();
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
     }
 
-    // Create a vector the size of the input image
-    vector<vector<Pixel>> image(height, vector<Pixel> (width));
+    int size() const
+    {
+        return thread_count;
+    }
+
+    /**
+     * Makes every later parallel_for call on this thread run serially on it
+     * Threads with a role of their own, such as pipeline stages, use this so
+     * they never queue behind another caller for the workers.
+     */
+    static void run_serially_on_this_thread()
+    {
+        inside_worker = true;
+    }
 
-    int pos = start;
-    // For each row, starting from the last row to the first
-    // Note: BMP files store pixels from bottom to top
-    for (int i = height - 1; i >= 0; i--)
+    /**
+     * Runs a body over the rows [0, count) and waits for it to finish
+     * Calls made from inside a worker run serially on that worker.
+     * @param count number of rows
+     * @param grain rows handed out at a time
+     * @param body  the work for a range of rows
+     */
+    void parallel_for(int count, int grain, const RowRangeBody& body)
     {
-        // For each column
-        for (int j = 0; j < width; j++)
+        grain = max(1, grain);
+        if (thread_count == 1 || count <= grain || inside_worker)
+        {
+            if (count > 0)
+            {
+                body(0, count);
+            }
+            return;
+        }
+
+        // Only one job runs at a time; other callers queue here
+        lock_guard<mutex> serial(run_mutex);
+        Job job(thread_count);
+        job.body = &body;
+        job.grain = grain;
+        job.count = count;
+        for (int i = 0; i < thread_count; i++)
+        {
+            long long begin = (long long)count * i / thread_count;
+            long long end = (long long)count * (i + 1) / thread_count;
+            job.ranges[i].store(pack(begin, end));
+        }
+
         {
-            // Go to the pixel position
-            stream.seekg(pos);
+            lock_guard<mutex> lock(job_mutex);
+            current = &job;
+            generation++;
+        }
+        job_ready.notify_all();
+
+        inside_worker = true;
+        run_job(job, thread_count - 1);
+        inside_worker = false;
+
+        // Wait until every row is done and no worker still looks at the job
+        unique_lock<mutex> lock(job_mutex);
+        job_done.wait(lock, [&] { return job.finished.load() == job.count && job.active == 0; });
+        current = nullptr;
+    }
+
+private:
+    struct Job
+    {
+        explicit Job(int participants) : ranges(new atomic<uint64_t>[participants]), participants(participants) {}
+
+        const RowRangeBody* body = nullptr;
+        int grain = 1;
+        int count = 0;
+        unique_ptr<atomic<uint64_t>[]> ranges;   // Remaining [begin, end) of each participant
+        int participants;
+        atomic<int> finished{0};                 // Rows completed
+        int active = 0;                          // Workers inside run_job, guarded by job_mutex
+    };
+
+    static uint64_t pack(uint32_t begin, uint32_t end)
+    {
+        return (uint64_t)begin << 32 | end;
+    }
 
-            // Save the pixel values to the image vector
-            // Note: BMP files store pixels in blue, green, red order
-            image[i][j].blue = stream.get();
-            image[i][j].green = stream.get();
-            image[i][j].red = stream.get();
+    /**
+     * Takes the next chunk from the front of a participant's own range
+     */
+    static bool take_front(Job& job, int self, int& begin, int& end)
+    {
+        uint64_t range = job.ranges[self].load();
+        while (true)
+        {
+            int b = range >> 32;
+            int e = (uint32_t)range;
+            if (b >= e)
+            {
+                return false;
+            }
+            int next = min(b + job.grain, e);
+            if (job.ranges[self].compare_exchange_weak(range, pack(next, e)))
+            {
+                begin = b;
+                end = next;
+                return true;
+            }
+        }
+    }
 
-            // We are ignoring the alpha channel if there is one
+    /**
+     * Moves the back half of another participant's range into our own
+     */
+    static bool steal(Job& job, int self)
+    {
+        for (int k = 1; k < job.participants; k++)
+        {
+            int victim = (self + k) % job.participants;
+            uint64_t range = job.ranges[victim].load();
+            while (true)
+            {
+                int b = range >> 32;
+                int e = (uint32_t)range;
+                if (b >= e)
+                {
+                    break;
+                }
+                int middle = e - b <= job.grain ? b : b + (e - b) / 2;
+                if (job.ranges[victim].compare_exchange_weak(range, pack(b, middle)))
+                {
+                    job.ranges[self].store(pack(middle, e));
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
 
-            // Advance the position to the next pixel
-            pos = pos + (bits_per_pixel / 8);
+    static void run_job(Job& job, int self)
+    {
+        int begin, end;
+        while (take_front(job, self, begin, end) || (steal(job, self) && take_front(job, self, begin, end)))
+        {
+            (*job.body)(begin, end);
+            job.finished += end - begin;
         }
+    }
+
+    void worker_loop(int self)
+    {
+        inside_worker = true;
+        uint64_t seen = 0;
+        while (true)
+        {
+            Job* job;
+            {
+                unique_lock<mutex> lock(job_mutex);
+                job_ready.wait(lock, [&] { return stopping || (current != nullptr && generation != seen); });
+                if (stopping)
+                {
+                    return;
+                }
+                seen = generation;
+                job = current;
+                job->active++;
+            }
+
+            run_job(*job, self);
 
-        // Skip the padding at the end of each row
-        stream.seekg(padding, ios::cur);
-        pos = pos + padding;
+            {
+                lock_guard<mutex> lock(job_mutex);
+                job->active--;
+            }
+            job_done.notify_all();
+        }
     }
 
-    // Close the stream and return the image vector
-    stream.close();
-    return image;
+    static thread_local bool inside_worker;
+
+    int thread_count;
+    vector<thread> workers;
+    mutex run_mutex;
+    mutex job_mutex;
+    condition_variable job_ready;
+    condition_variable job_done;
+    Job* current = nullptr;
+    uint64_t generation = 0;
+    bool stopping = false;
+};
+
+thread_local bool ThreadPool::inside_worker = false;
+
+// Number of threads for image operations; 0 until first configured
+int configured_threads = 0;
+
+/**
+ * Gets the shared thread pool, creating it on first use
+ * The size comes from set_thread_count(), then the IMGPROC_THREADS environment
+ * variable, then the number of hardware threads, and is at most MAX_THREADS.
+ * @return the pool
+ */
+ThreadPool& default_pool()
+{
+    static unique_ptr<ThreadPool> pool;
+    static int pool_request = 0;   // The size the pool was made for, which it may fall short of
+    static mutex pool_mutex;
+    lock_guard<mutex> lock(pool_mutex);
+    if (configured_threads <= 0)
+    {
+        const char* env = getenv("IMGPROC_THREADS");
+        long requested = env != nullptr ? strtol(env, nullptr, 10) : 0;
+        configured_threads = requested > 0 ? min<long>(requested, MAX_THREADS) : max(1u, thread::hardware_concurrency());
+    }
+    configured_threads = min(configured_threads, MAX_THREADS);
+    if (!pool || pool_request != configured_threads)
+    {
+        pool.reset();
+        pool.reset(new ThreadPool(configured_threads));
+        pool_request = configured_threads;
+    }
+    return *pool;
 }
 
 /**
- * Sets a value to the char array starting at the offset using the size
- * specified by the bytes.
- * This is a helper function for write_image()
- * @param arr    Array to set values for
- * @param offset Starting index offset
- * @param bytes  Number of bytes to set
- * @param value  Value to set
- * @return nothing
+ * Sets how many threads image operations use
+ * Call between operations, not while one is running.
+ * @param threads the thread count; 0 restores the default
  */
-void set_bytes(unsigned char arr[], int offset, int bytes, int value)
+void set_thread_count(int threads)
 {
-    for (int i = 0; i < bytes; i++)
+    configured_threads = threads;
+    default_pool();
+}
+
+// Occupancy of a queue between two threads and the time each side spent waiting on it
+struct QueueStats
+{
+    int capacity = 0;
+    uint64_t pushes = 0;
+    uint64_t depth_total = 0;       // Sum of the depths seen by each push, including the new item
+    int max_depth = 0;
+    uint64_t full_nanoseconds = 0;  // Producers waiting for space
+    uint64_t empty_nanoseconds = 0; // Consumers waiting for an item
+};
+
+// A first-in first-out queue of limited capacity between threads. Producers
+// wait while it is full and consumers while it is empty, so a slow consumer
+// holds its producers back instead of letting items pile up.
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(int capacity)
+    {
+        stats.capacity = max(1, capacity);
+    }
+
+    /**
+     * Adds an item, waiting for space
+     * @param item the item, moved into the queue
+     * @return false if the queue was closed, in which case the item is dropped
+     */
+    bool push(T&& item)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        if (!closed && (int)items.size() >= stats.capacity)
+        {
+            auto start = chrono::steady_clock::now();
+            not_full.wait(lock, [&] { return closed || (int)items.size() < stats.capacity; });
+            stats.full_nanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        }
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(move(item));
+        stats.pushes++;
+        stats.depth_total += items.size();
+        stats.max_depth = max<int>(stats.max_depth, items.size());
+        not_empty.notify_one();
+        return true;
+    }
+
+    /**
+     * Takes the oldest item, waiting for one
+     * @param item receives the item
+     * @return false once the queue is closed and empty
+     */
+    bool pop(T& item)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        if (!closed && items.empty())
+        {
+            auto start = chrono::steady_clock::now();
+            not_empty.wait(lock, [&] { return closed || !items.empty(); });
+            stats.empty_nanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        }
+        if (items.empty())
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /**
+     * Stops the queue taking items; what it holds can still be taken
+     */
+    void close()
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+    QueueStats statistics()
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        return stats;
+    }
+
+private:
+    mutex queue_mutex;
+    condition_variable not_full;
+    condition_variable not_empty;
+    deque<T> items;
+    bool closed = false;
+    QueueStats stats;
+};
+
+/**
+ * Splits a range of rows between the threads of the shared pool
+ * @param count number of rows
+ * @param body  the work for a range of rows
+ * @param grain rows handed out at a time; 0 picks a size from the thread count
+ */
+void parallel_rows(int count, const RowRangeBody& body, int grain = 0)
+{
+    ThreadPool& pool = default_pool();
+    if (grain <= 0)
+    {
+        grain = max(1, count / (pool.size() * 8));
+    }
+    pool.parallel_for(count, grain, body);
+}
+
+//***************************************************************************************************//
+//                                        IMAGE BUFFER POOL                                          //
+//***************************************************************************************************//
+
+// Smaller buffers come straight from the heap, which already serves them well
+const size_t POOL_MIN_BYTES = 64 << 10;
+
+// Transparent huge page size
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// Buffers from this size up are whole, aligned huge pages; from here on the
+// size classes are already spaced a huge page or more apart
+const size_t HUGE_CLASS_MIN = 4 * HUGE_PAGE_SIZE;
+
+// Idle buffers kept for reuse unless configured otherwise, in megabytes
+const double DEFAULT_POOL_IDLE_MB = 1024;
+
+// Activity of the buffer pool since it was configured
+struct PoolStats
+{
+    uint64_t hits = 0;            // Requests served by an idle buffer
+    uint64_t misses = 0;          // Requests that mapped a new buffer
+    uint64_t releases = 0;        // Buffers unmapped because the idle limit was reached
+    uint64_t resident_bytes = 0;  // Bytes mapped by the pool, in use or idle
+    uint64_t idle_bytes = 0;      // Bytes waiting in the pool for reuse
+};
+
+// Keeps freed image buffers for the next image of a similar size, so a
+// worker going through a stream of images stops mapping, faulting in and
+// unmapping hundreds of megabytes per image. Requests are rounded up to
+// size classes four to a power of two, which wastes at most a fifth of a
+// buffer. Classes from HUGE_CLASS_MIN up are mapped on huge page boundaries
+// and advised to use transparent huge pages. Safe to use from several threads.
+class BufferPool
+{
+public:
+    /**
+     * Gets a buffer of at least the given size
+     * @param bytes      the size needed
+     * @param class_size receives the usable size of the buffer
+     * @param fresh      receives whether the buffer was newly mapped
+     * @return the buffer, or null if the size is too small to pool or mapping failed
+     */
+    void* acquire(size_t bytes, size_t& class_size, bool& fresh)
+    {
+        if (bytes < POOL_MIN_BYTES)
+        {
+            return nullptr;
+        }
+        class_size = size_class(bytes);
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            vector<void*>& idle = idle_buffers[class_size];
+            if (!idle.empty())
+            {
+                void* buffer = idle.back();
+                idle.pop_back();
+                stats.idle_bytes -= class_size;
+                stats.hits++;
+                fresh = false;
+                return buffer;
+            }
+            stats.misses++;
+        }
+
+        void* buffer = map_buffer(class_size);
+        if (buffer != nullptr)
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            stats.resident_bytes += class_size;
+        }
+        fresh = true;
+        return buffer;
+    }
+
+    /**
+     * Takes back a buffer from acquire(), keeping it for reuse if there is room
+     * @param buffer     the buffer
+     * @param class_size the usable size acquire() reported
+     */
+    void release(void* buffer, size_t class_size)
+    {
+        {
+            lock_guard<mutex> lock(pool_mutex);
+            if (stats.idle_bytes + class_size <= max_idle_bytes)
+            {
+                idle_buffers[class_size].push_back(buffer);
+                stats.idle_bytes += class_size;
+                return;
+            }
+            stats.releases++;
+            stats.resident_bytes -= class_size;
+        }
+        munmap(buffer, class_size);
+    }
+
+    /**
+     * Changes how the pool behaves; idle buffers over the new limit are unmapped
+     * @param prefault       whether new buffers are faulted in when mapped
+     * @param max_idle_bytes the most bytes kept idle for reuse
+     */
+    void configure(bool prefault, size_t max_idle_bytes)
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        this->prefault = prefault;
+        this->max_idle_bytes = max_idle_bytes;
+        for (auto& entry : idle_buffers)
+        {
+            while (!entry.second.empty() && stats.idle_bytes > max_idle_bytes)
+            {
+                munmap(entry.second.back(), entry.first);
+                entry.second.pop_back();
+                stats.idle_bytes -= entry.first;
+                stats.resident_bytes -= entry.first;
+                stats.releases++;
+            }
+        }
+    }
+
+    PoolStats statistics()
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        return stats;
+    }
+
+    /**
+     * Rounds a request up to its size class
+     * @param bytes the size needed
+     * @return the size of the class that holds it
+     */
+    static size_t size_class(size_t bytes)
+    {
+        // Four classes per power of two: 1, 1.25, 1.5 and 1.75 times it
+        int top = 63 - __builtin_clzll(bytes);
+        size_t step = (size_t)1 << max(top - 2, 0);
+        size_t rounded = (bytes + step - 1) / step * step;
+        size_t page = rounded >= HUGE_CLASS_MIN ? HUGE_PAGE_SIZE : 4096;
+        return (rounded + page - 1) / page * page;
+    }
+
+private:
+    void* map_buffer(size_t class_size)
+    {
+        bool huge = class_size >= HUGE_CLASS_MIN;
+        // Over-map so the buffer can start on a huge page boundary, then trim
+        size_t slack = huge ? HUGE_PAGE_SIZE : 0;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | (prefault && !huge ? MAP_POPULATE : 0);
+        uint8_t* mapping = (uint8_t*)mmap(nullptr, class_size + slack, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        uint8_t* buffer = mapping;
+        if (huge)
+        {
+            buffer = (uint8_t*)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+            if (buffer > mapping)
+            {
+                munmap(mapping, buffer - mapping);
+            }
+            if (mapping + slack > buffer)
+            {
+                munmap(buffer + class_size, mapping + slack - buffer);
+            }
+            madvise(buffer, class_size, MADV_HUGEPAGE);
+            if (prefault)
+            {
+                // Touch after the advice so the faults can be served by huge pages
+                for (size_t offset = 0; offset < class_size; offset += 4096)
+                {
+                    buffer[offset] = 0;
+                }
+            }
+        }
+        return buffer;
+    }
+
+    mutex pool_mutex;
+    unordered_map<size_t, vector<void*>> idle_buffers;
+    PoolStats stats;
+    bool prefault = false;
+    size_t max_idle_bytes = DEFAULT_POOL_IDLE_MB * 1e6;
+};
+
+// Set once at startup; when off, image buffers come from the heap
+bool pool_enabled = false;
+
+/**
+ * Gets the shared buffer pool
+ * It is never destroyed, so images released during shutdown can still return to it.
+ * @return the pool
+ */
+BufferPool& buffer_pool()
+{
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+/**
+ * Turns the buffer pool on or off
+ * Call at startup, before any image is allocated.
+ * @param enabled        whether image buffers come from the pool
+ * @param prefault       whether new buffers are faulted in when mapped
+ * @param max_idle_bytes the most bytes kept idle for reuse
+ */
+void configure_buffer_pool(bool enabled, bool prefault, size_t max_idle_bytes)
+{
+    pool_enabled = enabled;
+    buffer_pool().configure(prefault, max_idle_bytes);
+}
+
+/**
+ * Reads the buffer pool settings from the environment
+ * IMGPROC_POOL turns the pool on ("1") or on with pre-faulting ("prefault");
+ * IMGPROC_POOL_IDLE_MB limits the idle bytes kept.
+ */
+void configure_buffer_pool_from_environment()
+{
+    const char* mode = getenv("IMGPROC_POOL");
+    const char* idle = getenv("IMGPROC_POOL_IDLE_MB");
+    bool enabled = mode != nullptr && (strcmp(mode, "1") == 0 || strcmp(mode, "prefault") == 0);
+    bool prefault = mode != nullptr && strcmp(mode, "prefault") == 0;
+    double max_idle_mb = idle != nullptr && atof(idle) >= 0 ? atof(idle) : DEFAULT_POOL_IDLE_MB;
+    configure_buffer_pool(enabled, prefault, max_idle_mb * 1e6);
+}
+
+//***************************************************************************************************//
+//                                             METRICS                                               //
+//***************************************************************************************************//
+
+// Stages that are timed and counted
+const int STAGE_READ = 0;
+const int STAGE_WRITE = 1;
+const int STAGE_PROCESS_1 = 2;            // process_1 .. process_10 follow in order
+const int STAGE_POINT_CHAIN = 12;
+const int STAGE_ROTATE = 13;
+const int STAGE_ENLARGE = 14;
+const int STAGE_STREAM_POINT = 15;
+const int STAGE_STREAM_ENLARGE = 16;
+const int STAGE_TILED_ROTATE = 17;
+const int STAGE_PYRAMID = 18;
+const int STAGE_PREVIEW = 19;
+const int STAGE_COUNT = 20;
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {
+    "read_bmp", "write_bmp", "process_1", "process_2", "process_3", "process_4", "process_5", "process_6",
+    "process_7", "process_8", "process_9", "process_10", "point_chain", "rotate", "enlarge",
+    "stream_point_chain", "stream_enlarge", "tiled_rotate", "pyramid", "preview",
+};
+
+// Totals of one stage; updated from any thread
+struct StageCounters
+{
+    atomic<uint64_t> calls{0};
+    atomic<uint64_t> nanoseconds{0};
+    atomic<uint64_t> pixels{0};
+    atomic<uint64_t> bytes_read{0};
+    atomic<uint64_t> bytes_written{0};
+    atomic<uint64_t> allocated_bytes{0};
+};
+
+// Set once at startup; every hook is a single test of this flag when it is off
+bool metrics_enabled = false;
+
+StageCounters stage_counters[STAGE_COUNT];
+
+// Queues of the last batch pipeline, decoded and filtered images; capacity 0 if none ran
+const int PIPELINE_QUEUE_COUNT = 2;
+const char* const PIPELINE_QUEUE_NAMES[PIPELINE_QUEUE_COUNT] = {"decoded", "filtered"};
+QueueStats pipeline_queues[PIPELINE_QUEUE_COUNT];
+
+// The innermost stage running on this thread, which image allocations are charged to
+thread_local int current_stage = -1;
+
+// Times a stage for as long as it is in scope and adds to its counters
+class StageTimer
+{
+public:
+    explicit StageTimer(int stage, uint64_t pixels = 0)
+    {
+        if (metrics_enabled)
+        {
+            this->stage = stage;
+            outer_stage = current_stage;
+            current_stage = stage;
+            start_time = chrono::steady_clock::now();
+            counters().calls.fetch_add(1, memory_order_relaxed);
+            add_pixels(pixels);
+        }
+    }
+
+    ~StageTimer()
+    {
+        if (stage >= 0)
+        {
+            auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time);
+            counters().nanoseconds.fetch_add(elapsed.count(), memory_order_relaxed);
+            current_stage = outer_stage;
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    void add_pixels(uint64_t count)
+    {
+        if (stage >= 0 && count != 0)
+        {
+            counters().pixels.fetch_add(count, memory_order_relaxed);
+        }
+    }
+
+    void add_bytes_read(uint64_t count)
+    {
+        if (stage >= 0)
+        {
+            counters().bytes_read.fetch_add(count, memory_order_relaxed);
+        }
+    }
+
+    void add_bytes_written(uint64_t count)
+    {
+        if (stage >= 0)
+        {
+            counters().bytes_written.fetch_add(count, memory_order_relaxed);
+        }
+    }
+
+private:
+    StageCounters& counters()
+    {
+        return stage_counters[stage];
+    }
+
+    int stage = -1;
+    int outer_stage = -1;
+    chrono::steady_clock::time_point start_time;
+};
+
+/**
+ * Charges an image allocation to the stage running on this thread
+ * @param bytes the size of the allocation
+ */
+inline void count_allocation(uint64_t bytes)
+{
+    if (metrics_enabled && current_stage >= 0)
+    {
+        stage_counters[current_stage].allocated_bytes.fetch_add(bytes, memory_order_relaxed);
+    }
+}
+
+// Where the metrics of a run are written when it ends
+struct MetricsOutputs
+{
+    string json;
+    string prometheus;
+};
+
+/**
+ * Reads the metrics files named by the IMGPROC_METRICS (JSON) and
+ * IMGPROC_METRICS_PROM (Prometheus) environment variables
+ * @return the files, which are empty names when unset
+ */
+MetricsOutputs metrics_from_environment()
+{
+    MetricsOutputs outputs;
+    const char* json = getenv("IMGPROC_METRICS");
+    const char* prometheus = getenv("IMGPROC_METRICS_PROM");
+    outputs.json = json != nullptr ? json : "";
+    outputs.prometheus = prometheus != nullptr ? prometheus : "";
+    return outputs;
+}
+
+/**
+ * Writes a file under a temporary name and renames it into place, so a
+ * scraper never reads a partial file
+ * @param filename the file to create or replace
+ * @param text     the contents
+ * @return true if the file was written
+ */
+bool write_file_atomically(const string& filename, const string& text)
+{
+    string temporary = filename + ".tmp-" + to_string(getpid());
+    ofstream out(temporary);
+    out << text;
+    out.close();
+    if (!out || rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Writes the stage counters as a JSON report and in the Prometheus text format
+ * Stages that never ran are left out of the JSON report. Stages can nest, so
+ * the stage times of a run may add up to more than the run time.
+ * @param outputs     the files to write; empty names are skipped
+ * @param run_seconds the wall time of the whole run
+ * @return true if every requested file was written
+ */
+bool write_metrics(const MetricsOutputs& outputs, double run_seconds)
+{
+    bool success = true;
+    char line[1024];
+
+    if (!outputs.json.empty())
+    {
+        string text = "{\n";
+        snprintf(line, sizeof(line), "  \"run_seconds\": %.6f,\n  \"threads\": %d,\n  \"stages\": {", run_seconds, default_pool().size());
+        text += line;
+        bool first = true;
+        for (int i = 0; i < STAGE_COUNT; i++)
+        {
+            const StageCounters& c = stage_counters[i];
+            if (c.calls == 0)
+            {
+                continue;
+            }
+            snprintf(line, sizeof(line),
+                     "%s\n    \"%s\": {\"calls\": %" PRIu64 ", \"seconds\": %.6f, \"pixels\": %" PRIu64 ", \"bytes_read\": %" PRIu64
+                     ", \"bytes_written\": %" PRIu64 ", \"allocated_bytes\": %" PRIu64 "}",
+                     first ? "" : ",", STAGE_NAMES[i], c.calls.load(), c.nanoseconds / 1e9, c.pixels.load(),
+                     c.bytes_read.load(), c.bytes_written.load(), c.allocated_bytes.load());
+            text += line;
+            first = false;
+        }
+        text += "\n  }";
+        if (pool_enabled)
+        {
+            PoolStats pool = buffer_pool().statistics();
+            snprintf(line, sizeof(line),
+                     ",\n  \"pool\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64 ", \"releases\": %" PRIu64
+                     ", \"resident_bytes\": %" PRIu64 ", \"idle_bytes\": %" PRIu64 "}",
+                     pool.hits, pool.misses, pool.releases, pool.resident_bytes, pool.idle_bytes);
+            text += line;
+        }
+        if (pipeline_queues[0].capacity != 0)
+        {
+            text += ",\n  \"pipeline\": {";
+            for (int q = 0; q < PIPELINE_QUEUE_COUNT; q++)
+            {
+                const QueueStats& queue = pipeline_queues[q];
+                snprintf(line, sizeof(line),
+                         "%s\n    \"%s\": {\"capacity\": %d, \"pushes\": %" PRIu64 ", \"mean_depth\": %.3f, \"max_depth\": %d"
+                         ", \"full_seconds\": %.6f, \"empty_seconds\": %.6f}",
+                         q == 0 ? "" : ",", PIPELINE_QUEUE_NAMES[q], queue.capacity, queue.pushes,
+                         queue.pushes != 0 ? (double)queue.depth_total / queue.pushes : 0.0, queue.max_depth,
+                         queue.full_nanoseconds / 1e9, queue.empty_nanoseconds / 1e9);
+                text += line;
+            }
+            text += "\n  }";
+        }
+        text += "\n}\n";
+        success = write_file_atomically(outputs.json, text) && success;
+    }
+
+    if (!outputs.prometheus.empty())
+    {
+        const struct { const char* name; const char* help; } metrics[] = {
+            {"imgproc_stage_calls_total", "Times the stage ran."},
+            {"imgproc_stage_seconds_total", "Wall time spent in the stage."},
+            {"imgproc_stage_pixels_total", "Pixels the stage processed."},
+            {"imgproc_stage_bytes_read_total", "Bytes the stage read from files."},
+            {"imgproc_stage_bytes_written_total", "Bytes the stage wrote to files."},
+            {"imgproc_stage_allocated_bytes_total", "Bytes of image buffers the stage allocated."},
+        };
+        string text;
+        for (int m = 0; m < 6; m++)
+        {
+            text += string("# HELP ") + metrics[m].name + " " + metrics[m].help + "\n";
+            text += string("# TYPE ") + metrics[m].name + " counter\n";
+            for (int i = 0; i < STAGE_COUNT; i++)
+            {
+                const StageCounters& c = stage_counters[i];
+                uint64_t values[] = {c.calls, 0, c.pixels, c.bytes_read, c.bytes_written, c.allocated_bytes};
+                if (m == 1)
+                {
+                    snprintf(line, sizeof(line), "%s{stage=\"%s\"} %.9f\n", metrics[m].name, STAGE_NAMES[i], c.nanoseconds / 1e9);
+                }
+                else
+                {
+                    snprintf(line, sizeof(line), "%s{stage=\"%s\"} %" PRIu64 "\n", metrics[m].name, STAGE_NAMES[i], values[m]);
+                }
+                text += line;
+            }
+        }
+        snprintf(line, sizeof(line), "# HELP imgproc_run_seconds Wall time of the last run.\n"
+                 "# TYPE imgproc_run_seconds gauge\nimgproc_run_seconds %.6f\n", run_seconds);
+        text += line;
+        if (pool_enabled)
+        {
+            PoolStats pool = buffer_pool().statistics();
+            snprintf(line, sizeof(line),
+                     "# HELP imgproc_pool_hits_total Image buffers reused from the pool.\n"
+                     "# TYPE imgproc_pool_hits_total counter\nimgproc_pool_hits_total %" PRIu64 "\n"
+                     "# HELP imgproc_pool_misses_total Image buffers the pool had to map.\n"
+                     "# TYPE imgproc_pool_misses_total counter\nimgproc_pool_misses_total %" PRIu64 "\n"
+                     "# HELP imgproc_pool_resident_bytes Bytes mapped by the pool, in use or idle.\n"
+                     "# TYPE imgproc_pool_resident_bytes gauge\nimgproc_pool_resident_bytes %" PRIu64 "\n"
+                     "# HELP imgproc_pool_idle_bytes Bytes waiting in the pool for reuse.\n"
+                     "# TYPE imgproc_pool_idle_bytes gauge\nimgproc_pool_idle_bytes %" PRIu64 "\n",
+                     pool.hits, pool.misses, pool.resident_bytes, pool.idle_bytes);
+            text += line;
+        }
+        if (pipeline_queues[0].capacity != 0)
+        {
+            text += "# HELP imgproc_pipeline_queue_max_depth Most items held by a pipeline queue.\n"
+                    "# TYPE imgproc_pipeline_queue_max_depth gauge\n";
+            for (int q = 0; q < PIPELINE_QUEUE_COUNT; q++)
+            {
+                snprintf(line, sizeof(line), "imgproc_pipeline_queue_max_depth{queue=\"%s\"} %d\n",
+                         PIPELINE_QUEUE_NAMES[q], pipeline_queues[q].max_depth);
+                text += line;
+            }
+            text += "# HELP imgproc_pipeline_queue_full_seconds_total Time producers waited on a full pipeline queue.\n"
+                    "# TYPE imgproc_pipeline_queue_full_seconds_total counter\n";
+            for (int q = 0; q < PIPELINE_QUEUE_COUNT; q++)
+            {
+                snprintf(line, sizeof(line), "imgproc_pipeline_queue_full_seconds_total{queue=\"%s\"} %.9f\n",
+                         PIPELINE_QUEUE_NAMES[q], pipeline_queues[q].full_nanoseconds / 1e9);
+                text += line;
+            }
+            text += "# HELP imgproc_pipeline_queue_empty_seconds_total Time consumers waited on an empty pipeline queue.\n"
+                    "# TYPE imgproc_pipeline_queue_empty_seconds_total counter\n";
+            for (int q = 0; q < PIPELINE_QUEUE_COUNT; q++)
+            {
+                snprintf(line, sizeof(line), "imgproc_pipeline_queue_empty_seconds_total{queue=\"%s\"} %.9f\n",
+                         PIPELINE_QUEUE_NAMES[q], pipeline_queues[q].empty_nanoseconds / 1e9);
+                text += line;
+            }
+        }
+        success = write_file_atomically(outputs.prometheus, text) && success;
+    }
+    return success;
+}
+
+//***************************************************************************************************//
+//                                    COMPACT IMAGE BUFFER                                           //
+//***************************************************************************************************//
+
+// Every scanline starts on a cache line boundary
+const int ROW_ALIGNMENT = 64;
+
+// Byte offsets of each channel inside an interleaved pixel
+const int BLUE = 0;
+const int GREEN = 1;
+const int RED = 2;
+const int ALPHA = 3;
+
+/**
+ * Releases a pixel buffer obtained from make_image(), to the pool it came from if any
+ */
+struct PixelBufferDeleter
+{
+    size_t pooled_bytes = 0;   // Size class of a pooled buffer; 0 for a heap buffer
+
+    void operator()(uint8_t* data) const
+    {
+        if (pooled_bytes != 0)
+        {
+            buffer_pool().release(data, pooled_bytes);
+        }
+        else
+        {
+            free(data);
+        }
+    }
+};
+
+// Image structure
+// One contiguous allocation of 8-bit channels stored blue, green, red
+// (and alpha when channels is 4), top row first. Rows are padded to
+// ROW_ALIGNMENT bytes so stride is always a multiple of the alignment.
+struct Image
+{
+    int width = 0;       // Pixels per row
+    int height = 0;      // Number of rows
+    int channels = 3;    // 3 for BGR, 4 for BGRA
+    size_t stride = 0;   // Bytes from the start of one row to the next
+    size_t capacity = 0; // Bytes the buffer holds, which may exceed stride * height
+    unique_ptr<uint8_t[], PixelBufferDeleter> data;
+
+    uint8_t* row(int y)
+    {
+        return data.get() + y * stride;
+    }
+
+    const uint8_t* row(int y) const
+    {
+        return data.get() + y * stride;
+    }
+
+    bool empty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+};
+
+/**
+ * Rounds a row of pixels up to the next multiple of ROW_ALIGNMENT bytes
+ * @param width    the row width in pixels
+ * @param channels the number of bytes per pixel
+ * @return the row stride in bytes
+ */
+size_t aligned_stride(int width, int channels)
+{
+    size_t bytes = (size_t)width * channels;
+    return (bytes + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+}
+
+/**
+ * Allocates an image buffer without clearing it
+ * @param width    width of the image in pixels
+ * @param height   height of the image in pixels
+ * @param channels 3 for BGR or 4 for BGRA
+ * @return the new image, or an empty image if the size is invalid
+ */
+Image allocate_image(int width, int height, int channels)
+{
+    Image image;
+    if (width <= 0 || height <= 0 || (channels != 3 && channels != 4))
+    {
+        return image;
+    }
+
+    size_t stride = aligned_stride(width, channels);
+    size_t bytes = stride * height;
+    PixelBufferDeleter deleter;
+    bool fresh = true;
+    void* data = pool_enabled ? buffer_pool().acquire(bytes, deleter.pooled_bytes, fresh) : nullptr;
+    if (data == nullptr)
+    {
+        deleter.pooled_bytes = 0;
+        data = aligned_alloc(ROW_ALIGNMENT, bytes);
+    }
+    if (data == nullptr)
+    {
+        return image;
+    }
+    if (fresh)
+    {
+        count_allocation(bytes);
+    }
+
+    image.width = width;
+    image.height = height;
+    image.channels = channels;
+    image.stride = stride;
+    image.capacity = deleter.pooled_bytes != 0 ? deleter.pooled_bytes : bytes;
+    image.data = unique_ptr<uint8_t[], PixelBufferDeleter>((uint8_t*)data, deleter);
+    return image;
+}
+
+/**
+ * Gives an image new dimensions, keeping its buffer when it is large enough
+ * Pixels are left undefined. This is how the *_into functions reuse
+ * caller-owned storage instead of allocating an image per call.
+ * @param image    the image to reshape
+ * @param width    width of the image in pixels
+ * @param height   height of the image in pixels
+ * @param channels 3 for BGR or 4 for BGRA
+ * @return true if the image now has the requested shape
+ */
+bool reshape_image(Image& image, int width, int height, int channels)
+{
+    if (width <= 0 || height <= 0 || (channels != 3 && channels != 4))
+    {
+        return false;
+    }
+    size_t stride = aligned_stride(width, channels);
+    if (image.data && stride * height <= image.capacity)
+    {
+        image.width = width;
+        image.height = height;
+        image.channels = channels;
+        image.stride = stride;
+        return true;
+    }
+    image = allocate_image(width, height, channels);
+    return !image.empty();
+}
+
+/**
+ * Allocates a zero-filled image buffer
+ * @param width    width of the image in pixels
+ * @param height   height of the image in pixels
+ * @param channels 3 for BGR or 4 for BGRA
+ * @return the new image, or an empty image if the size is invalid
+ */
+Image make_image(int width, int height, int channels = 3)
+{
+    Image image = allocate_image(width, height, channels);
+    if (!image.empty())
+    {
+        memset(image.row(0), 0, image.stride * image.height);
+    }
+    return image;
+}
+
+/**
+ * Copies an image into caller-owned storage
+ * @param image the image to copy
+ * @param dst   receives the same pixels; its buffer is reused if large enough
+ * @return true if the copy was made
+ */
+bool copy_image_into(const Image& image, Image& dst)
+{
+    if (&dst == &image)
+    {
+        return true;
+    }
+    if (!reshape_image(dst, image.width, image.height, image.channels))
+    {
+        return false;
+    }
+    parallel_rows(image.height, [&](int begin, int end) {
+        memcpy(dst.row(begin), image.row(begin), image.stride * (end - begin));
+    });
+    return true;
+}
+
+/**
+ * Makes a deep copy of an image
+ * @param image the image to copy
+ * @return a new image holding the same pixels
+ */
+Image clone_image(const Image& image)
+{
+    Image copy;
+    copy_image_into(image, copy);
+    return copy;
+}
+
+/**
+ * Converts a vector of vector of Pixels into a compact image buffer
+ * Channel values are stored as bytes, exactly as write_image() would store them
+ * @param image the image as a vector of vector of Pixels
+ * @return the image as a BGR buffer
+ */
+Image to_image(const vector<vector<Pixel>>& image)
+{
+    if (image.empty() || image[0].empty())
+    {
+        return Image();
+    }
+
+    int num_rows = image.size();
+    int num_columns = image[0].size();
+    Image new_image = make_image(num_columns, num_rows, 3);
+
+    for (int row = 0; row < num_rows; row++)
+    {
+        uint8_t* dst = new_image.row(row);
+        for (int col = 0; col < num_columns; col++)
+        {
+            dst[col * 3 + BLUE] = image[row][col].blue;
+            dst[col * 3 + GREEN] = image[row][col].green;
+            dst[col * 3 + RED] = image[row][col].red;
+        }
+    }
+    return new_image;
+}
+
+/**
+ * Converts a compact image buffer into a vector of vector of Pixels
+ * Any alpha channel is dropped
+ * @param image the image buffer
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> to_pixels(const Image& image)
+{
+    if (image.empty())
+    {
+        return {};
+    }
+
+    vector<vector<Pixel>> new_image(image.height, vector<Pixel> (image.width));
+    for (int row = 0; row < image.height; row++)
+    {
+        const uint8_t* src = image.row(row);
+        for (int col = 0; col < image.width; col++)
+        {
+            const uint8_t* px = src + col * image.channels;
+            new_image[row][col].blue = px[BLUE];
+            new_image[row][col].green = px[GREEN];
+            new_image[row][col].red = px[RED];
+        }
+    }
+    return new_image;
+}
+
+//***************************************************************************************************//
+//                                      BMP FILE INPUT/OUTPUT                                        //
+//***************************************************************************************************//
+
+// Sizes of the fixed BMP headers
+const int BMP_HEADER_SIZE = 14;
+const int DIB_HEADER_SIZE = 40;
+
+// Header bytes needed to read the BI_BITFIELDS channel masks, which follow the
+// 40-byte DIB header or sit at the same offset inside the larger V2-V5 headers
+const int MAX_HEADER_SIZE = BMP_HEADER_SIZE + DIB_HEADER_SIZE + 16;
+
+// Compression methods
+const uint32_t BI_RGB = 0;
+const uint32_t BI_BITFIELDS = 3;
+
+// Files are read through the fallback path in blocks of at least this many bytes
+const size_t READ_BLOCK_SIZE = 4 << 20;
+
+// BMP image properties
+struct BmpInfo
+{
+    int width = 0;             // Width in pixels
+    int height = 0;            // Height in pixels
+    int bits_per_pixel = 0;    // 24 or 32
+    size_t pixel_offset = 0;   // File offset of the first scanline
+    size_t row_bytes = 0;      // Bytes per scanline, including padding
+    bool top_down = false;     // True if the first scanline is the top row
+
+    /**
+     * Finds the image row stored at a position in the pixel array
+     * @param k index of the scanline within the file
+     * @return the image row it holds
+     */
+    int image_row(int k) const
+    {
+        return top_down ? k : height - 1 - k;
+    }
+};
+
+/**
+ * Reads a little-endian unsigned integer from a byte array
+ * @param bytes the array to read from
+ * @param count the number of bytes to read (at most 4)
+ * @return the integer stored in the array
+ */
+uint32_t get_uint(const uint8_t* bytes, int count)
+{
+    uint32_t result = 0;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        result = (result << 8) | bytes[i];
+    }
+    return result;
+}
+
+/**
+ * Validates the BMP and DIB headers and fills in the image properties
+ * @param header    the first bytes of the file
+ * @param size      the number of header bytes available
+ * @param file_size the size of the whole file in bytes
+ * @param info      receives the image properties
+ * @param error     receives a description of the problem if the header is rejected
+ * @return true if the file holds an uncompressed 24 or 32-bit image we can decode
+ */
+bool parse_bmp_header(const uint8_t* header, size_t size, uint64_t file_size, BmpInfo& info, string& error)
+{
+    if (size < BMP_HEADER_SIZE + DIB_HEADER_SIZE || header[0] != 'B' || header[1] != 'M')
+    {
+        error = "not a BMP file";
+        return false;
+    }
+
+    uint32_t dib_size = get_uint(header + 14, 4);
+    int32_t width = (int32_t)get_uint(header + 18, 4);
+    int32_t height = (int32_t)get_uint(header + 22, 4);
+    uint32_t planes = get_uint(header + 26, 2);
+    uint32_t bits_per_pixel = get_uint(header + 28, 2);
+    uint32_t compression = get_uint(header + 30, 4);
+    uint64_t pixel_offset = get_uint(header + 10, 4);
+
+    if (dib_size < DIB_HEADER_SIZE)
+    {
+        error = "unsupported DIB header size " + to_string(dib_size);
+        return false;
+    }
+    if (planes != 1)
+    {
+        error = "invalid number of color planes";
+        return false;
+    }
+    if (bits_per_pixel != 24 && bits_per_pixel != 32)
+    {
+        error = "unsupported bit depth " + to_string(bits_per_pixel);
+        return false;
+    }
+    // 32-bit images may spell out their channel layout with masks, which we
+    // accept as long as they describe the same BGRA order as BI_RGB
+    uint64_t header_end = BMP_HEADER_SIZE + dib_size;
+    if (compression == BI_BITFIELDS && bits_per_pixel == 32)
+    {
+        if (dib_size == DIB_HEADER_SIZE)
+        {
+            header_end += 12;
+        }
+        bool has_alpha_mask = dib_size >= DIB_HEADER_SIZE + 16;
+        if (size < (size_t)(BMP_HEADER_SIZE + DIB_HEADER_SIZE + (has_alpha_mask ? 16 : 12)))
+        {
+            error = "missing channel masks";
+            return false;
+        }
+        uint32_t alpha_mask = has_alpha_mask ? get_uint(header + 66, 4) : 0;
+        if (get_uint(header + 54, 4) != 0x00FF0000 || get_uint(header + 58, 4) != 0x0000FF00
+            || get_uint(header + 62, 4) != 0x000000FF || (alpha_mask != 0 && alpha_mask != 0xFF000000))
+        {
+            error = "unsupported channel masks";
+            return false;
+        }
+    }
+    else if (compression != BI_RGB)
+    {
+        error = "unsupported compression method " + to_string(compression);
+        return false;
+    }
+
+    // A negative height marks a file stored from top to bottom
+    bool top_down = height < 0 && height != INT32_MIN;
+    if (top_down)
+    {
+        height = -height;
+    }
+    if (width <= 0 || height <= 0)
+    {
+        error = "invalid image size " + to_string(width) + "x" + to_string(height);
+        return false;
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    uint64_t row_bytes = ((uint64_t)width * (bits_per_pixel / 8) + 3) / 4 * 4;
+    if (pixel_offset < header_end || pixel_offset > file_size
+        || row_bytes * height > file_size - pixel_offset)
+    {
+        error = "pixel data does not fit in the file";
+        return false;
+    }
+
+    info.width = width;
+    info.height = height;
+    info.bits_per_pixel = bits_per_pixel;
+    info.pixel_offset = pixel_offset;
+    info.row_bytes = row_bytes;
+    info.top_down = top_down;
+    return true;
+}
+
+/**
+ * Converts consecutive scanlines from a BMP file into rows of an image
+ * Note: BMP files normally store rows from bottom to top, so file row k is
+ * image row height-1-k; top-down files store them in image order
+ * @param info  the image properties
+ * @param src   the first scanline to convert
+ * @param first index of that scanline within the file
+ * @param count number of scanlines to convert
+ * @param image the destination image
+ */
+void decode_scanlines(const BmpInfo& info, const uint8_t* src, int first, int count, Image& image)
+{
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    for (int k = first; k < first + count; k++, src += info.row_bytes)
+    {
+        uint8_t* dst = image.row(info.image_row(k));
+        if (bytes_per_pixel == image.channels)
+        {
+            memcpy(dst, src, (size_t)info.width * bytes_per_pixel);
+            continue;
+        }
+
+        // We are ignoring the alpha channel if there is one
+        const uint8_t* px = src;
+        for (int j = 0; j < info.width; j++, px += bytes_per_pixel, dst += 3)
+        {
+            dst[BLUE] = px[BLUE];
+            dst[GREEN] = px[GREEN];
+            dst[RED] = px[RED];
+        }
+    }
+}
+
+/**
+ * Reads exactly the requested number of bytes from a file descriptor
+ * @param fd     the file to read from
+ * @param buffer the buffer to fill
+ * @param bytes  the number of bytes to read
+ * @param offset the file offset to start reading at
+ * @return true if all the bytes were read
+ */
+bool read_fully(int fd, uint8_t* buffer, size_t bytes, uint64_t offset)
+{
+    while (bytes > 0)
+    {
+        ssize_t n = pread(fd, buffer, bytes, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        buffer += n;
+        bytes -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/**
+ * Reads the BMP image specified into caller-owned storage
+ * The file is memory mapped and converted a whole scanline at a time. If it
+ * cannot be mapped, it is read in large blocks instead.
+ * @param filename BMP image filename
+ * @param image    receives the image as a BGR buffer, or BGRA for 32-bit files;
+ *                 its buffer is reused if large enough, and it is left empty
+ *                 if the file is not valid
+ * @param error    if not null, receives a description of why the file was rejected
+ * @return true if the image was read
+ */
+bool read_bmp_into(const string& filename, Image& image, string* error = nullptr)
+{
+    StageTimer timer(STAGE_READ);
+    string message;
+    image.width = image.height = 0;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0)
+    {
+        message = string("cannot open file: ") + strerror(errno);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (error != nullptr)
+        {
+            *error = message;
+        }
+        return false;
+    }
+
+    uint64_t file_size = file_stat.st_size;
+    uint8_t header[MAX_HEADER_SIZE];
+    BmpInfo info;
+    if (!read_fully(fd, header, min<uint64_t>(sizeof(header), file_size), 0)
+        || !parse_bmp_header(header, min<uint64_t>(sizeof(header), file_size), file_size, info, message))
+    {
+        if (message.empty())
+        {
+            message = "cannot read header";
+        }
+    }
+    else if (!reshape_image(image, info.width, info.height, info.bits_per_pixel / 8))
+    {
+        message = "out of memory";
+    }
+    else
+    {
+        timer.add_pixels((uint64_t)info.width * info.height);
+        timer.add_bytes_read(info.pixel_offset + (uint64_t)info.row_bytes * info.height);
+        void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            madvise(mapping, file_size, MADV_SEQUENTIAL);
+            const uint8_t* pixels = (const uint8_t*)mapping + info.pixel_offset;
+            parallel_rows(info.height, [&](int begin, int end) {
+                decode_scanlines(info, pixels + begin * info.row_bytes, begin, end - begin, image);
+            });
+            munmap(mapping, file_size);
+        }
+        else
+        {
+            // Read as many whole scanlines as fit in one block
+            int rows_per_block = max<size_t>(1, READ_BLOCK_SIZE / info.row_bytes);
+            vector<uint8_t> block(rows_per_block * info.row_bytes);
+            for (int k = 0; k < info.height; k += rows_per_block)
+            {
+                int count = min(rows_per_block, info.height - k);
+                if (!read_fully(fd, block.data(), count * info.row_bytes, info.pixel_offset + k * info.row_bytes))
+                {
+                    message = "unexpected end of file";
+                    image.width = image.height = 0;
+                    break;
+                }
+                decode_scanlines(info, block.data(), k, count, image);
+            }
+        }
+    }
+
+    close(fd);
+    if (!message.empty() && error != nullptr)
+    {
+        *error = message;
+    }
+    return message.empty();
+}
+
+/**
+ * Reads the BMP image specified and returns the resulting image buffer
+ * @param filename BMP image filename
+ * @param error    if not null, receives a description of why the file was rejected
+ * @return the image as a BGR or BGRA buffer, or an empty image if the file is not valid
+ */
+Image read_bmp(const string& filename, string* error = nullptr)
+{
+    Image image;
+    read_bmp_into(filename, image, error);
+    return image;
+}
+
+// Byte count and elapsed time of a file transfer
+struct IoStats
+{
+    uint64_t bytes = 0;
+    double seconds = 0;
+
+    double megabytes_per_second() const
+    {
+        return seconds > 0 ? bytes / seconds / 1e6 : 0;
+    }
+};
+
+// Largest number of buffers passed to a single writev() call
+const int MAX_WRITE_VECTORS = IOV_MAX < 1024 ? IOV_MAX : 1024;
+
+/**
+ * Builds the BMP and DIB headers for an image
+ * @param header         receives BMP_HEADER_SIZE + DIB_HEADER_SIZE bytes
+ * @param width          width of the image in pixels
+ * @param height         height of the image in pixels
+ * @param bits_per_pixel bits per pixel of the pixel array
+ * @param array_bytes    receives the size of the pixel array in bytes, including padding
+ * @return false, with errno set to EFBIG, if the file is too large for the 32-bit BMP size fields
+ */
+bool make_bmp_header(unsigned char header[], int width, int height, int bits_per_pixel, uint64_t& array_bytes)
+{
+    unsigned char* bmp_header = header;
+    unsigned char* dib_header = header + BMP_HEADER_SIZE;
+    memset(header, 0, BMP_HEADER_SIZE + DIB_HEADER_SIZE);
+
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    uint64_t width_bytes = ((uint64_t)width * (bits_per_pixel / 8) + 3) / 4 * 4;
+
+    // Pixel array size in bytes, including padding
+    array_bytes = width_bytes * height;
+    if (BMP_HEADER_SIZE + DIB_HEADER_SIZE + array_bytes > UINT32_MAX)
+    {
+        errno = EFBIG;
+        return false;
+    }
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
+    set_bytes(bmp_header,  6, 2, 0);                // Reserved
+    set_bytes(bmp_header,  8, 2, 0);                // Reserved
+    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width);            // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height);           // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, bits_per_pixel);   // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
+    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
+    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
+
+    return true;
+}
+
+/**
+ * Converts a run of pixels between the BGR and BGRA layouts
+ * Pixels that gain an alpha channel are made opaque. The runs may overlap if
+ * dst does not start after src and the pixels do not grow.
+ * @param src          the pixels to convert
+ * @param src_channels bytes per source pixel
+ * @param dst          receives the converted pixels
+ * @param dst_channels bytes per destination pixel
+ * @param count        the number of pixels
+ */
+void repack_pixels(const uint8_t* src, int src_channels, uint8_t* dst, int dst_channels, int count)
+{
+    if (src_channels == dst_channels)
+    {
+        memmove(dst, src, (size_t)count * src_channels);
+        return;
+    }
+    for (int j = 0; j < count; j++, src += src_channels, dst += dst_channels)
+    {
+        dst[BLUE] = src[BLUE];
+        dst[GREEN] = src[GREEN];
+        dst[RED] = src[RED];
+        if (dst_channels == 4)
+        {
+            dst[ALPHA] = 255;
+        }
+    }
+}
+
+/**
+ * Converts one image row into a BMP scanline, including padding
+ * BGR rows written as 32-bit get an opaque alpha channel, and BGRA rows
+ * written as 24-bit lose theirs.
+ * @param image          the source image
+ * @param y              the row to convert
+ * @param dst            receives the scanline
+ * @param bits_per_pixel depth of the scanline, 24 or 32
+ * @return the number of bytes stored in dst
+ */
+size_t encode_scanline(const Image& image, int y, uint8_t* dst, int bits_per_pixel = 24)
+{
+    const uint8_t* src = image.row(y);
+    int bytes_per_pixel = bits_per_pixel / 8;
+    size_t pixel_bytes = (size_t)image.width * bytes_per_pixel;
+    size_t row_bytes = (pixel_bytes + 3) / 4 * 4;
+
+    repack_pixels(src, image.channels, dst, bytes_per_pixel, image.width);
+    memset(dst + pixel_bytes, 0, row_bytes - pixel_bytes);
+    return row_bytes;
+}
+
+/**
+ * Writes every byte described by a list of buffers, retrying short writes
+ * @param fd    the file to write to
+ * @param iov   the buffers to write; entries are modified as they are consumed
+ * @param count the number of buffers
+ * @return true if everything was written
+ */
+bool write_all(int fd, struct iovec* iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = writev(fd, iov, min(count, MAX_WRITE_VECTORS));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return false;
+        }
+
+        // Skip the buffers that were written completely
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+/**
+ * Picks an unused name beside an output to build it under before renaming it into place
+ * @param filename the output
+ * @return the name, or an empty string if the output is a device, pipe or
+ *         other special file that must be written directly
+ */
+string output_temporary_name(const string& filename)
+{
+    static atomic<uint64_t> next_temporary{0};
+    struct stat file_stat;
+    if (stat(filename.c_str(), &file_stat) == 0 && !S_ISREG(file_stat.st_mode))
+    {
+        return "";
+    }
+    return filename + ".partial-" + to_string(getpid()) + "-" + to_string(next_temporary++);
+}
+
+/**
+ * Creates the file that is written in place of an output
+ * A regular output is written under a temporary name beside it and only
+ * replaces it in replace_output(), so the old file, which may be the input
+ * still being read or a hard link shared with another path, is never
+ * truncated, and a failed write leaves no partial output behind. Devices,
+ * pipes and other special files are opened and written directly.
+ * @param filename  the output
+ * @param temporary receives the name the file is written under; empty when it is the output itself
+ * @param access    O_WRONLY or O_RDWR
+ * @return the open file, or -1 with errno set
+ */
+int create_output(const string& filename, string& temporary, int access = O_WRONLY)
+{
+    temporary = output_temporary_name(filename);
+    if (temporary.empty())
+    {
+        return open(filename.c_str(), access | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    return open(temporary.c_str(), access | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+}
+
+/**
+ * Closes a file from create_output() and puts it in place of the output
+ * @param fd        the file
+ * @param temporary the name it was written under
+ * @param filename  the output
+ * @param success   whether everything was written; if not, the file is removed instead
+ * @return true if the output was replaced, false with errno set otherwise
+ */
+bool replace_output(int fd, const string& temporary, const string& filename, bool success)
+{
+    int reason = errno;
+    if (close(fd) != 0 && success)
+    {
+        success = false;
+        reason = errno;
+    }
+    if (success && !temporary.empty() && rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        success = false;
+        reason = errno;
+    }
+    if (!success)
+    {
+        if (!temporary.empty())
+        {
+            unlink(temporary.c_str());
+        }
+        errno = reason;
+    }
+    return success;
+}
+
+/**
+ * Writes image rows as BMP scanlines in file order, bottom row first
+ * Rows are converted in parallel into a block of scanlines that is flushed in
+ * large writes.
+ * @param fd             the file to write to, positioned where the rows belong
+ * @param image          the rows to write
+ * @param bits_per_pixel depth of the scanlines, 24 or 32
+ * @param block          holds the converted scanlines; grown as needed and kept for reuse
+ * @return true if everything was written
+ */
+bool write_scanlines(int fd, const Image& image, int bits_per_pixel, vector<uint8_t>& block)
+{
+    size_t row_bytes = ((size_t)image.width * (bits_per_pixel / 8) + 3) / 4 * 4;
+    int rows_per_block = min<size_t>(image.height, max<size_t>(1, READ_BLOCK_SIZE / row_bytes));
+    block.resize(max(block.size(), rows_per_block * row_bytes));
+    bool success = true;
+    for (int h = image.height - 1; h >= 0 && success; )
+    {
+        int count = min(rows_per_block, h + 1);
+        int top = h;
+        parallel_rows(count, [&](int begin, int end) {
+            for (int k = begin; k < end; k++)
+            {
+                encode_scanline(image, top - k, block.data() + k * row_bytes, bits_per_pixel);
+            }
+        });
+        h -= count;
+        struct iovec chunk = {block.data(), count * row_bytes};
+        success = write_all(fd, &chunk, 1);
+    }
+    return success;
+}
+
+/**
+ * Write the input image buffer to a 24 or 32-bit BMP file name specified
+ * Rows whose layout already matches the file are handed to writev() straight
+ * from the image, interleaved with their padding, so no pixel is copied.
+ * Other rows are repacked into a reusable block of scanlines that is flushed
+ * in large writes.
+ * @param filename       The BMP file name to save the image to
+ * @param image          The input image to save
+ * @param stats          If not null, receives the bytes written and elapsed time
+ * @param bits_per_pixel Depth of the file: 24, 32, or 0 to match the image
+ * @return True if successful and false otherwise
+ */
+bool write_bmp(const string& filename, const Image& image, IoStats* stats = nullptr, int bits_per_pixel = 24)
+{
+    if (bits_per_pixel == 0)
+    {
+        bits_per_pixel = image.channels * 8;
+    }
+    if (image.empty() || (bits_per_pixel != 24 && bits_per_pixel != 32))
+    {
+        return false;
+    }
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+    uint64_t array_bytes;
+    if (!make_bmp_header(header, image.width, image.height, bits_per_pixel, array_bytes))
+    {
+        return false;
+    }
+    StageTimer timer(STAGE_WRITE, (uint64_t)image.width * image.height);
+    auto start_time = chrono::steady_clock::now();
+
+    // Write a new file that replaces the old one once it is complete
+    string temporary;
+    int fd = create_output(filename, temporary);
+
+    // If there was a problem opening the file, return false
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    size_t pixel_bytes = (size_t)image.width * (bits_per_pixel / 8);
+    size_t row_bytes = (pixel_bytes + 3) / 4 * 4;
+    static const uint8_t padding[3] = {0};
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    bool success = true;
+    vector<struct iovec> iov;
+    iov.reserve(MAX_WRITE_VECTORS);
+    iov.push_back({header, sizeof(header)});
+    if (image.channels * 8 == bits_per_pixel)
+    {
+        for (int h = image.height - 1; h >= 0 && success; h--)
+        {
+            iov.push_back({(void*)image.row(h), pixel_bytes});
+            if (row_bytes > pixel_bytes)
+            {
+                iov.push_back({(void*)padding, row_bytes - pixel_bytes});
+            }
+            if ((int)iov.size() >= MAX_WRITE_VECTORS - 1)
+            {
+                success = write_all(fd, iov.data(), iov.size());
+                iov.clear();
+            }
+        }
+        success = success && write_all(fd, iov.data(), iov.size());
+    }
+    else
+    {
+        vector<uint8_t> block;
+        success = write_all(fd, iov.data(), 1) && write_scanlines(fd, image, bits_per_pixel, block);
+    }
+
+    // Close the file, put it in place and report how it went
+    success = replace_output(fd, temporary, filename, success);
+    if (success)
+    {
+        timer.add_bytes_written(sizeof(header) + array_bytes);
+    }
+    if (stats != nullptr)
+    {
+        stats->bytes = success ? sizeof(header) + array_bytes : 0;
+        stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    }
+    return success;
+}
+
+/**
+ * Reads the BMP image specified and returns the resulting image as a vector
+ * @param filename BMP image filename
+ * @return the image as a vector of vector of Pixels
+ */
+vector<vector<Pixel>> read_image(string filename)
+{
+    return to_pixels(read_bmp(filename));
+}
+
+/**
+ * Write the input image to a BMP file name specified
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image(string filename, const vector<vector<Pixel>>& image)
+{
+    return write_bmp(filename, to_image(image));
+}
+
+//***************************************************************************************************//
+//                                       POINT FILTER KERNELS                                        //
+//***************************************************************************************************//
+
+// Point filters compute each output pixel from the input pixel at the same
+// position, so they can run in place on any run of pixels from a row.
+
+// A run of pixels from one image row
+struct RowSpan
+{
+    uint8_t* pixels = nullptr;   // First pixel of the run
+    int count = 0;               // Number of pixels in the run
+    int channels = 3;            // Bytes per pixel
+    int x = 0;                   // Column of the first pixel
+    int y = 0;                   // Row of the run
+    int num_columns = 0;         // Width of the whole image
+    int num_rows = 0;            // Height of the whole image
+};
+
+// A point filter and its parameter, identified by its menu number
+struct PointOp
+{
+    int process = 0;             // 1, 2, 3, 7, 8, 9 or 10
+    double scaling_factor = 0;   // Used by process 2, 8 and 9
+};
+
+/**
+ * Checks whether a menu number names a point filter
+ * @param process the menu number
+ * @return true for vignette, clarendon, grayscale, high contrast, lighten, darken and black/white/red/green/blue
+ */
+bool is_point_op(int process)
+{
+    return process == 1 || process == 2 || process == 3 || (process >= 7 && process <= 10);
+}
+
+// Scalar filters are pixel functors: filter(px, i) changes the i-th pixel of a
+// run, px, in place. for_each_pixel() is the one loop over a run, instantiated
+// per functor and per pixel format so the functor inlines into it and the pixel
+// stride is a constant.
+
+/**
+ * Applies a pixel functor to every pixel of a run of pixels
+ * @param pixels the first pixel of the run
+ * @param count  the number of pixels
+ * @param filter the functor to apply
+ */
+template <int CHANNELS, class Filter>
+inline void for_each_pixel(uint8_t* pixels, int count, const Filter& filter)
+{
+    for (int i = 0; i < count; i++)
+    {
+        filter(pixels + i * CHANNELS, i);
+    }
+}
+
+/**
+ * Applies a pixel functor to a run of BGR or BGRA pixels
+ * @param span   the pixels to change
+ * @param filter the functor to apply
+ */
+template <class Filter>
+void apply_pixel_filter(const RowSpan& span, const Filter& filter)
+{
+    if (span.channels == 4)
+    {
+        for_each_pixel<4>(span.pixels, span.count, filter);
+    }
+    else
+    {
+        for_each_pixel<3>(span.pixels, span.count, filter);
+    }
+}
+
+// Largest possible sum of the blue, green and red channels
+const int MAX_CHANNEL_SUM = 3 * 255;
+
+// Fixed thresholds of the filters that couple the three channels
+constexpr int CONTRAST_CUT = 255/2;          // High contrast: averages from here up turn white
+constexpr int CLARENDON_LIGHTEN_FROM = 170;  // Clarendon: averages from here up are lightened
+constexpr int CLARENDON_DARKEN_BELOW = 90;   // Clarendon: averages below this are darkened
+constexpr int BWRGB_WHITE_FROM = 550;        // Black/white/red/green/blue: sums from here up are white
+constexpr int BWRGB_BLACK_UP_TO = 150;       // Black/white/red/green/blue: sums up to here are black
+
+// Channel curves of the scale-based filters; also the classes stored in SumTables::clarendon
+const uint8_t CURVE_DARKEN = 0;     // c*scaling_factor
+const uint8_t CURVE_KEEP = 1;       // c
+const uint8_t CURVE_LIGHTEN = 2;    // 255-(255-c)*scaling_factor
+
+// Classes stored in SumTables::bwrgb
+const uint8_t BWRGB_BLACK = 0;
+const uint8_t BWRGB_WHITE = 1;
+const uint8_t BWRGB_COLOR = 2;
+
+// Outputs of the filters that couple the three channels, indexed by the channel
+// sum. Each of these filters only looks at the colour through the sum (and, for
+// black/white/red/green/blue, which channel is largest), so a table over the
+// 766 possible sums replaces a full 256x256x256 colour table exactly.
+struct SumTables
+{
+    uint8_t grey[MAX_CHANNEL_SUM + 1] = {};        // Average used by grayscale
+    uint8_t contrast[MAX_CHANNEL_SUM + 1] = {};    // High contrast output value
+    uint8_t clarendon[MAX_CHANNEL_SUM + 1] = {};   // Which curve clarendon applies
+    uint8_t bwrgb[MAX_CHANNEL_SUM + 1] = {};       // Black, white or colour
+};
+
+/**
+ * Builds the channel sum tables from the original per-pixel formulas
+ * @return the tables
+ */
+constexpr SumTables build_sum_tables()
+{
+    SumTables tables;
+    for (int sum = 0; sum <= MAX_CHANNEL_SUM; sum++)
+    {
+        int average = sum/3;
+        tables.grey[sum] = average;
+        tables.contrast[sum] = average >= CONTRAST_CUT ? 255 : 0;
+
+        if (average >= CLARENDON_LIGHTEN_FROM){
+            tables.clarendon[sum] = CURVE_LIGHTEN;
+        }
+        else if (average < CLARENDON_DARKEN_BELOW){
+            tables.clarendon[sum] = CURVE_DARKEN;
+        }
+        else{
+            tables.clarendon[sum] = CURVE_KEEP;
+        }
+
+        if(sum >= BWRGB_WHITE_FROM){
+            tables.bwrgb[sum] = BWRGB_WHITE;
+        }
+        else if(sum <= BWRGB_BLACK_UP_TO){
+            tables.bwrgb[sum] = BWRGB_BLACK;
+        }
+        else{
+            tables.bwrgb[sum] = BWRGB_COLOR;
+        }
+    }
+    return tables;
+}
+
+// The channel sum tables, generated by the compiler
+constexpr SumTables SUM_TABLES = build_sum_tables();
+
+// Scale curves in 16.16 fixed point: c*scaling_factor becomes the integer
+// product of c and a factor close to scaling_factor*65536, shifted down 16 bits
+const int FIXED_POINT_BITS = 16;
+
+// Fixed-point factors stay below this so the products of 8-bit values, shifted
+// down, fit the 16-bit lanes of the vector kernels
+const uint32_t FIXED_POINT_LIMIT = 1 << 24;
+
+// A scale curve in fixed point; the product of a channel value and the factor
+// is rounded up when its 16-bit fraction is above the threshold
+struct FixedCurve
+{
+    bool exact = false;        // True if the curve reproduces its double-precision table
+    uint32_t factor = 0;       // The scaling factor in 16.16 fixed point
+    uint32_t threshold = 0;    // Fractions above this round the product up
+};
+
+// A point filter with its per-channel lookup tables built, ready to apply
+struct PreparedOp
+{
+    int process = 0;
+    double scaling_factor = 0;
+    uint8_t curves[3][256];  // Channel tables indexed by CURVE_DARKEN, CURVE_KEEP or CURVE_LIGHTEN
+    FixedCurve fixed[3];     // The curves in fixed point, indexed like curves; CURVE_KEEP is unused
+};
+
+/**
+ * Computes a scale curve in fixed point for one channel value
+ * Darken is the integer part of c*scale and lighten is 255 minus (255-c)*scale
+ * rounded up, since 255 minus the product is truncated; a lightened value
+ * that would go negative is truncated toward zero instead.
+ * @param c       the channel value
+ * @param curve   the curve in fixed point
+ * @param lighten true for the lighten curve, false for darken
+ * @return the new value, before it is stored in a byte
+ */
+inline int fixed_curve_value(int c, const FixedCurve& curve, bool lighten)
+{
+    uint64_t product = (uint64_t)(lighten ? 255 - c : c) * curve.factor;
+    int whole = (int)(product >> FIXED_POINT_BITS);
+    uint32_t fraction = product & ((1 << FIXED_POINT_BITS) - 1);
+    if (!lighten)
+    {
+        return whole + (fraction > curve.threshold);
+    }
+    return 255 - whole - (fraction > curve.threshold && whole < 255);
+}
+
+/**
+ * Looks for a rounding threshold that makes a fixed-point factor reproduce a curve
+ * Each channel value either needs its product rounded up or not, which bounds
+ * the threshold from below and above; any threshold in between works.
+ * @param table   the double-precision curve to match
+ * @param factor  the candidate factor
+ * @param lighten true for the lighten curve, false for darken
+ * @param curve   receives the factor and threshold if one works
+ * @return true if the curve is reproduced for every channel value
+ */
+bool fit_fixed_curve(const uint8_t table[256], uint32_t factor, bool lighten, FixedCurve& curve)
+{
+    int64_t lowest = 0;            // Thresholds must be at least this
+    int64_t highest = 0xFFFF;      // and at most this
+    for (int c = 0; c < 256; c++)
+    {
+        FixedCurve plain = {true, factor, 0xFFFF};
+        FixedCurve rounded = {true, factor, 0};
+        uint64_t product = (uint64_t)(lighten ? 255 - c : c) * factor;
+        int64_t fraction = product & ((1 << FIXED_POINT_BITS) - 1);
+        bool plain_matches = (uint8_t)fixed_curve_value(c, plain, lighten) == table[c];
+        bool rounded_matches = (uint8_t)fixed_curve_value(c, rounded, lighten) == table[c];
+        if (plain_matches && !rounded_matches)
+        {
+            lowest = max(lowest, fraction);
+        }
+        else if (rounded_matches && !plain_matches)
+        {
+            highest = min(highest, fraction - 1);
+        }
+        else if (!plain_matches)
+        {
+            return false;
+        }
+    }
+    if (lowest > highest)
+    {
+        return false;
+    }
+    curve = {true, factor, (uint32_t)lowest};
+    return true;
+}
+
+/**
+ * Picks 16.16 fixed-point versions of the scale curves of a filter
+ * Double products of decimal scales such as 0.01 land exactly on whole numbers
+ * that no 16.16 factor reaches, so the nearest factor and its neighbours are
+ * tried, each with its own rounding threshold, and every channel value is
+ * checked against the tables. A curve with no exact version keeps exact false
+ * and the vector kernels use doubles for it.
+ * @param op the filter with its curves built
+ */
+void choose_fixed_curves(PreparedOp& op)
+{
+    double nearest = nearbyint(op.scaling_factor * (1 << FIXED_POINT_BITS));
+    if (!(nearest >= 0 && nearest < FIXED_POINT_LIMIT))
+    {
+        return;
+    }
+    for (uint8_t curve : {CURVE_DARKEN, CURVE_LIGHTEN})
+    {
+        for (int offset : {0, -1, 1, -2, 2})
+        {
+            int64_t factor = (int64_t)nearest + offset;
+            if (factor >= 0 && factor < FIXED_POINT_LIMIT
+                && fit_fixed_curve(op.curves[curve], factor, curve == CURVE_LIGHTEN, op.fixed[curve]))
+            {
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Builds the lookup tables for a point filter
+ * Table entries are truncated to int and stored as bytes, exactly like the
+ * per-pixel arithmetic they replace. Fixed-point versions of the curves are
+ * chosen for the vector kernels where they reproduce the tables.
+ * @param op the filter and its parameter
+ * @return the filter ready to apply
+ */
+PreparedOp prepare_point_op(const PointOp& op)
+{
+    PreparedOp prepared;
+    prepared.process = op.process;
+    prepared.scaling_factor = op.scaling_factor;
+    for (int c = 0; c < 256; c++)
+    {
+        prepared.curves[CURVE_DARKEN][c] = (int)(c*op.scaling_factor);
+        prepared.curves[CURVE_KEEP][c] = c;
+        prepared.curves[CURVE_LIGHTEN][c] = (int)(255-(255-c)*op.scaling_factor);
+    }
+    choose_fixed_curves(prepared);
+    return prepared;
+}
+
+// Darkens pixels by their distance from the image centre
+// pow(d, 2) of an integer distance is the correctly rounded square, so the
+// squares are plain multiplies; the result is identical to the original
+// sqrt(pow()+pow()) formula.
+struct VignetteFilter
+{
+    int num_rows;
+    double dy_squared;   // Squared distance of the row from the centre row
+    double dx;           // Distance of the first pixel from the centre column
+
+    explicit VignetteFilter(const RowSpan& span)
+        : num_rows(span.num_rows)
+    {
+        double dy = span.y - (num_rows/2);
+        dy_squared = dy * dy;
+        dx = span.x - (span.num_columns/2);
+    }
+
+    void operator()(uint8_t* px, int i) const
+    {
+        double x = dx + i;
+        double distance = sqrt(x * x + dy_squared);
+        double scaling_factor = (num_rows - distance)/num_rows;
+
+        px[BLUE] = (int)(px[BLUE]*scaling_factor);
+        px[GREEN] = (int)(px[GREEN]*scaling_factor);
+        px[RED] = (int)(px[RED]*scaling_factor);
+    }
+};
+
+// Maps the three colour channels through one table; lighten and darken
+struct ChannelLutFilter
+{
+    const uint8_t* table;   // Output for each input channel value
+
+    void operator()(uint8_t* px, int) const
+    {
+        px[BLUE] = table[px[BLUE]];
+        px[GREEN] = table[px[GREEN]];
+        px[RED] = table[px[RED]];
+    }
+};
+
+// Maps the colour channels through the curve the channel sum selects
+struct ClarendonFilter
+{
+    const uint8_t (*curves)[256];   // PreparedOp::curves
+
+    void operator()(uint8_t* px, int) const
+    {
+        const uint8_t* table = curves[SUM_TABLES.clarendon[px[BLUE] + px[GREEN] + px[RED]]];
+        px[BLUE] = table[px[BLUE]];
+        px[GREEN] = table[px[GREEN]];
+        px[RED] = table[px[RED]];
+    }
+};
+
+// Replaces the colour channels with a value chosen by the channel sum; grayscale and high contrast
+struct SumLutFilter
+{
+    const uint8_t* table;   // Output value for each channel sum
+
+    void operator()(uint8_t* px, int) const
+    {
+        uint8_t value = table[px[BLUE] + px[GREEN] + px[RED]];
+
+        px[BLUE] = value;
+        px[GREEN] = value;
+        px[RED] = value;
+    }
+};
+
+// Black, white, red, green and blue as blue, green, red bytes
+const uint8_t BWRGB_PALETTE[5][3] = {{0, 0, 0}, {255, 255, 255}, {0, 0, 255}, {0, 255, 0}, {255, 0, 0}};
+
+// Replaces each pixel with black, white, or its largest primary
+struct BwrgbFilter
+{
+    void operator()(uint8_t* px, int) const
+    {
+        int blue_color = px[BLUE];
+        int green_color = px[GREEN];
+        int red_color = px[RED];
+        int kind = SUM_TABLES.bwrgb[red_color + green_color + blue_color];
+
+        // Red, green, or blue when no single channel is largest
+        int red_largest = (red_color > green_color) & (red_color > blue_color);
+        int green_largest = (green_color > blue_color) & (green_color > red_color);
+        int largest = 2 - 2 * red_largest - green_largest;
+        const uint8_t* color = BWRGB_PALETTE[kind + (kind == BWRGB_COLOR) * largest];
+
+        px[BLUE] = color[BLUE];
+        px[GREEN] = color[GREEN];
+        px[RED] = color[RED];
+    }
+};
+
+//***************************************************************************************************//
+//                                          SIMD KERNELS                                             //
+//***************************************************************************************************//
+
+// Vector versions of the point filters for BGR and BGRA pixels. Each kernel
+// handles as many whole blocks of pixels as it can and returns how many it did;
+// the scalar kernels finish the rest. Every kernel gives bit-identical results
+// to the scalar tables: sums and averages are exact integer arithmetic, and the
+// scale curves use either fixed-point versions checked against the tables or
+// the same double-precision operations as prepare_point_op().
+// Kernels are templates over the bytes per pixel; BGRA blocks split into four
+// channel vectors with aligned 4-byte pixels, and alpha is written back as it was.
+
+// Handles the first pixels of a run and returns how many it handled
+typedef int (*SpanKernel)(uint8_t* pixels, int count, const PreparedOp& op);
+
+// The largest block a span kernel handles at once, so the most of a run it leaves to the scalar kernels
+const int SPAN_KERNEL_BLOCK_BYTES = 192;
+
+// The kernels chosen for this CPU; a null entry means the scalar kernel is used
+struct KernelSet
+{
+    const char* name = "scalar";
+    int (*vignette)(const RowSpan& span) = nullptr;
+    SpanKernel clarendon = nullptr;
+    SpanKernel grayscale = nullptr;
+    SpanKernel high_contrast = nullptr;
+    SpanKernel lighten = nullptr;
+    SpanKernel darken = nullptr;
+    SpanKernel bwrgb = nullptr;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Shuffle controls that split 16 interleaved BGR pixels (three 16-byte blocks)
+// into one vector per channel, and merge them back.
+struct BgrShuffles
+{
+    int8_t split[3][3][16];   // [channel][source block][channel byte]
+    int8_t merge[3][3][16];   // [output block][channel][output byte]
+
+    BgrShuffles()
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            for (int b = 0; b < 3; b++)
+            {
+                for (int i = 0; i < 16; i++)
+                {
+                    // Byte 3*i+a holds channel a of pixel i
+                    int pos = 3 * i + a;
+                    split[a][b][i] = pos / 16 == b ? pos % 16 : -1;
+
+                    // Output block a, byte i holds channel pos%3 of pixel pos/3
+                    pos = 16 * a + i;
+                    merge[a][b][i] = pos % 3 == b ? pos / 3 : -1;
+                }
+            }
+        }
+    }
+};
+
+const BgrShuffles& bgr_shuffles()
+{
+    static const BgrShuffles shuffles;
+    return shuffles;
+}
+
+// Splits and merges 16 BGR pixels per 128-bit lane
+struct BgrLanes128
+{
+    __m128i split[3][3];
+    __m128i merge[3][3];
+
+    __attribute__((target("sse4.1"))) BgrLanes128()
+    {
+        const BgrShuffles& s = bgr_shuffles();
+        for (int a = 0; a < 3; a++)
+        {
+            for (int b = 0; b < 3; b++)
+            {
+                split[a][b] = _mm_loadu_si128((const __m128i*)s.split[a][b]);
+                merge[a][b] = _mm_loadu_si128((const __m128i*)s.merge[a][b]);
+            }
+        }
+    }
+};
+
+__attribute__((target("sse4.1")))
+inline void split_bgr_sse(const BgrLanes128& lanes, const uint8_t* src, __m128i channel[3])
+{
+    __m128i block[3];
+    for (int b = 0; b < 3; b++)
+    {
+        block[b] = _mm_loadu_si128((const __m128i*)(src + 16 * b));
+    }
+    for (int a = 0; a < 3; a++)
+    {
+        channel[a] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(block[0], lanes.split[a][0]),
+                                               _mm_shuffle_epi8(block[1], lanes.split[a][1])),
+                                  _mm_shuffle_epi8(block[2], lanes.split[a][2]));
+    }
+}
+
+__attribute__((target("sse4.1")))
+inline void merge_bgr_sse(const BgrLanes128& lanes, const __m128i channel[3], uint8_t* dst)
+{
+    for (int a = 0; a < 3; a++)
+    {
+        __m128i block = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(channel[0], lanes.merge[a][0]),
+                                                  _mm_shuffle_epi8(channel[1], lanes.merge[a][1])),
+                                     _mm_shuffle_epi8(channel[2], lanes.merge[a][2]));
+        _mm_storeu_si128((__m128i*)(dst + 16 * a), block);
+    }
+}
+
+/**
+ * Transposes a 4x4 block of BGRA pixels in registers
+ * Output row m holds column m of the four input rows.
+ * @param rows the four input rows, each 4 pixels long; replaced by the output rows
+ */
+inline void transpose_4x4(__m128i rows[4])
+{
+    __m128i t0 = _mm_unpacklo_epi32(rows[0], rows[1]);
+    __m128i t1 = _mm_unpacklo_epi32(rows[2], rows[3]);
+    __m128i t2 = _mm_unpackhi_epi32(rows[0], rows[1]);
+    __m128i t3 = _mm_unpackhi_epi32(rows[2], rows[3]);
+    rows[0] = _mm_unpacklo_epi64(t0, t1);
+    rows[1] = _mm_unpackhi_epi64(t0, t1);
+    rows[2] = _mm_unpacklo_epi64(t2, t3);
+    rows[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+// Gathers each channel of the four BGRA pixels in a 128-bit lane into one
+// 32-bit group: byte 4p+c moves to 4c+p, which is its own inverse
+const int8_t BGRA_GROUPS[16] = {0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15};
+
+/**
+ * Splits 16 BGRA pixels (four 16-byte blocks) into one vector per channel
+ * Grouping the channels within each block and transposing the groups leaves
+ * channel c in vector c, block b supplying bytes 4b to 4b+3.
+ */
+__attribute__((target("sse4.1")))
+inline void split_bgra_sse(const uint8_t* src, __m128i channel[4])
+{
+    const __m128i groups = _mm_loadu_si128((const __m128i*)BGRA_GROUPS);
+    for (int b = 0; b < 4; b++)
+    {
+        channel[b] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 16 * b)), groups);
+    }
+    transpose_4x4(channel);
+}
+
+__attribute__((target("sse4.1")))
+inline void merge_bgra_sse(const __m128i channel[4], uint8_t* dst)
+{
+    const __m128i groups = _mm_loadu_si128((const __m128i*)BGRA_GROUPS);
+    __m128i block[4] = {channel[0], channel[1], channel[2], channel[3]};
+    transpose_4x4(block);
+    for (int b = 0; b < 4; b++)
+    {
+        _mm_storeu_si128((__m128i*)(dst + 16 * b), _mm_shuffle_epi8(block[b], groups));
+    }
+}
+
+/**
+ * Splits 16 pixels into one vector per channel
+ * @param channel receives the blue, green and red vectors, and alpha for BGRA
+ */
+template <int CHANNELS>
+__attribute__((target("sse4.1")))
+inline void split_pixels_sse(const BgrLanes128& lanes, const uint8_t* src, __m128i channel[4])
+{
+    if (CHANNELS == 4)
+    {
+        split_bgra_sse(src, channel);
+    }
+    else
+    {
+        split_bgr_sse(lanes, src, channel);
+    }
+}
+
+template <int CHANNELS>
+__attribute__((target("sse4.1")))
+inline void merge_pixels_sse(const BgrLanes128& lanes, const __m128i channel[4], uint8_t* dst)
+{
+    if (CHANNELS == 4)
+    {
+        merge_bgra_sse(channel, dst);
+    }
+    else
+    {
+        merge_bgr_sse(lanes, channel, dst);
+    }
+}
+
+/**
+ * Adds the three channels of 16 pixels as 16-bit lanes
+ * @param channel the blue, green and red vectors
+ * @param lo      receives the sums of pixels 0-7
+ * @param hi      receives the sums of pixels 8-15
+ */
+__attribute__((target("sse4.1")))
+inline void channel_sums_sse(const __m128i channel[3], __m128i& lo, __m128i& hi)
+{
+    __m128i zero = _mm_setzero_si128();
+    lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(channel[0], zero), _mm_unpacklo_epi8(channel[1], zero)),
+                       _mm_unpacklo_epi8(channel[2], zero));
+    hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(channel[0], zero), _mm_unpackhi_epi8(channel[1], zero)),
+                       _mm_unpackhi_epi8(channel[2], zero));
+}
+
+template <int CHANNELS>
+__attribute__((target("sse4.1")))
+int grayscale_sse41(uint8_t* pixels, int count, const PreparedOp&)
+{
+    static const BgrLanes128 lanes;
+    const __m128i third = _mm_set1_epi16((short)0xAAAB);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i channel[4], lo, hi;
+        split_pixels_sse<CHANNELS>(lanes, pixels + CHANNELS * i, channel);
+        channel_sums_sse(channel, lo, hi);
+
+        // sum/3 is (sum*0xAAAB)>>17 for every possible sum
+        lo = _mm_srli_epi16(_mm_mulhi_epu16(lo, third), 1);
+        hi = _mm_srli_epi16(_mm_mulhi_epu16(hi, third), 1);
+        channel[0] = channel[1] = channel[2] = _mm_packus_epi16(lo, hi);
+        merge_pixels_sse<CHANNELS>(lanes, channel, pixels + CHANNELS * i);
+    }
+    return i;
+}
+
+template <int CHANNELS>
+__attribute__((target("sse4.1")))
+int high_contrast_sse41(uint8_t* pixels, int count, const PreparedOp&)
+{
+    static const BgrLanes128 lanes;
+    // grey >= 127 exactly when the sum is at least 381
+    const __m128i cut = _mm_set1_epi16(3 * CONTRAST_CUT - 1);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i channel[4], lo, hi;
+        split_pixels_sse<CHANNELS>(lanes, pixels + CHANNELS * i, channel);
+        channel_sums_sse(channel, lo, hi);
+        channel[0] = channel[1] = channel[2] = _mm_packs_epi16(_mm_cmpgt_epi16(lo, cut), _mm_cmpgt_epi16(hi, cut));
+        merge_pixels_sse<CHANNELS>(lanes, channel, pixels + CHANNELS * i);
+    }
+    return i;
+}
+
+template <int CHANNELS>
+__attribute__((target("sse4.1")))
+int bwrgb_sse41(uint8_t* pixels, int count, const PreparedOp&)
+{
+    static const BgrLanes128 lanes;
+    const __m128i white_cut = _mm_set1_epi16(BWRGB_WHITE_FROM - 1);
+    const __m128i black_cut = _mm_set1_epi16(BWRGB_BLACK_UP_TO);
+    const __m128i sign = _mm_set1_epi8((char)0x80);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i channel[4], lo, hi;
+        split_pixels_sse<CHANNELS>(lanes, pixels + CHANNELS * i, channel);
+        channel_sums_sse(channel, lo, hi);
+        __m128i white = _mm_packs_epi16(_mm_cmpgt_epi16(lo, white_cut), _mm_cmpgt_epi16(hi, white_cut));
+        __m128i not_black = _mm_packs_epi16(_mm_cmpgt_epi16(lo, black_cut), _mm_cmpgt_epi16(hi, black_cut));
+        __m128i color = _mm_andnot_si128(white, not_black);
+
+        // Unsigned byte comparisons
+        __m128i b = _mm_xor_si128(channel[BLUE], sign);
+        __m128i g = _mm_xor_si128(channel[GREEN], sign);
+        __m128i r = _mm_xor_si128(channel[RED], sign);
+        __m128i red = _mm_and_si128(_mm_cmpgt_epi8(r, g), _mm_cmpgt_epi8(r, b));
+        __m128i green = _mm_and_si128(_mm_cmpgt_epi8(g, b), _mm_cmpgt_epi8(g, r));
+        __m128i blue = _mm_andnot_si128(_mm_or_si128(red, green), _mm_set1_epi8(-1));
+
+        channel[RED] = _mm_or_si128(white, _mm_and_si128(color, red));
+        channel[GREEN] = _mm_or_si128(white, _mm_and_si128(color, green));
+        channel[BLUE] = _mm_or_si128(white, _mm_and_si128(color, blue));
+        merge_pixels_sse<CHANNELS>(lanes, channel, pixels + CHANNELS * i);
+    }
+    return i;
+}
+
+// Splits and merges 32 BGR pixels, 16 in each 128-bit lane
+struct BgrLanes256
+{
+    __m256i split[3][3];
+    __m256i merge[3][3];
+
+    __attribute__((target("avx2"))) BgrLanes256()
+    {
+        const BgrShuffles& s = bgr_shuffles();
+        for (int a = 0; a < 3; a++)
+        {
+            for (int b = 0; b < 3; b++)
+            {
+                split[a][b] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)s.split[a][b]));
+                merge[a][b] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)s.merge[a][b]));
+            }
+        }
+    }
+};
+
+__attribute__((target("avx2")))
+inline void split_bgr_avx2(const BgrLanes256& lanes, const uint8_t* src, __m256i channel[3])
+{
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)src);
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(src + 32));
+    __m256i v2 = _mm256_loadu_si256((const __m256i*)(src + 64));
+
+    // Gather pixels 0-15 into the low lanes and pixels 16-31 into the high lanes
+    __m256i block[3];
+    block[0] = _mm256_permute2x128_si256(v0, v1, 0x30);
+    block[1] = _mm256_permute2x128_si256(v0, v2, 0x21);
+    block[2] = _mm256_permute2x128_si256(v1, v2, 0x30);
+    for (int a = 0; a < 3; a++)
+    {
+        channel[a] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(block[0], lanes.split[a][0]),
+                                                     _mm256_shuffle_epi8(block[1], lanes.split[a][1])),
+                                     _mm256_shuffle_epi8(block[2], lanes.split[a][2]));
+    }
+}
+
+__attribute__((target("avx2")))
+inline void merge_bgr_avx2(const BgrLanes256& lanes, const __m256i channel[3], uint8_t* dst)
+{
+    __m256i block[3];
+    for (int a = 0; a < 3; a++)
+    {
+        block[a] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(channel[0], lanes.merge[a][0]),
+                                                   _mm256_shuffle_epi8(channel[1], lanes.merge[a][1])),
+                                   _mm256_shuffle_epi8(channel[2], lanes.merge[a][2]));
+    }
+    _mm256_storeu_si256((__m256i*)dst, _mm256_permute2x128_si256(block[0], block[1], 0x20));
+    _mm256_storeu_si256((__m256i*)(dst + 32), _mm256_permute2x128_si256(block[2], block[0], 0x30));
+    _mm256_storeu_si256((__m256i*)(dst + 64), _mm256_permute2x128_si256(block[1], block[2], 0x31));
+}
+
+/**
+ * Splits 32 BGRA pixels (four 32-byte blocks) into one vector per channel
+ * Each 128-bit lane is split like split_bgra_sse().
+ */
+__attribute__((target("avx2")))
+inline void split_bgra_avx2(const uint8_t* src, __m256i channel[4])
+{
+    const __m256i groups = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)BGRA_GROUPS));
+    __m256i block[4];
+    for (int b = 0; b < 4; b++)
+    {
+        block[b] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + 32 * b)), groups);
+    }
+    __m256i t0 = _mm256_unpacklo_epi32(block[0], block[1]);
+    __m256i t1 = _mm256_unpacklo_epi32(block[2], block[3]);
+    __m256i t2 = _mm256_unpackhi_epi32(block[0], block[1]);
+    __m256i t3 = _mm256_unpackhi_epi32(block[2], block[3]);
+    channel[BLUE] = _mm256_unpacklo_epi64(t0, t1);
+    channel[GREEN] = _mm256_unpackhi_epi64(t0, t1);
+    channel[RED] = _mm256_unpacklo_epi64(t2, t3);
+    channel[ALPHA] = _mm256_unpackhi_epi64(t2, t3);
+}
+
+__attribute__((target("avx2")))
+inline void merge_bgra_avx2(const __m256i channel[4], uint8_t* dst)
+{
+    const __m256i groups = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)BGRA_GROUPS));
+    __m256i t0 = _mm256_unpacklo_epi32(channel[BLUE], channel[GREEN]);
+    __m256i t1 = _mm256_unpacklo_epi32(channel[RED], channel[ALPHA]);
+    __m256i t2 = _mm256_unpackhi_epi32(channel[BLUE], channel[GREEN]);
+    __m256i t3 = _mm256_unpackhi_epi32(channel[RED], channel[ALPHA]);
+    __m256i block[4] = {_mm256_unpacklo_epi64(t0, t1), _mm256_unpackhi_epi64(t0, t1),
+                        _mm256_unpacklo_epi64(t2, t3), _mm256_unpackhi_epi64(t2, t3)};
+    for (int b = 0; b < 4; b++)
+    {
+        _mm256_storeu_si256((__m256i*)(dst + 32 * b), _mm256_shuffle_epi8(block[b], groups));
+    }
+}
+
+/**
+ * Splits 32 pixels into one vector per channel
+ * @param channel receives the blue, green and red vectors, and alpha for BGRA
+ */
+template <int CHANNELS>
+__attribute__((target("avx2")))
+inline void split_pixels_avx2(const BgrLanes256& lanes, const uint8_t* src, __m256i channel[4])
+{
+    if (CHANNELS == 4)
+    {
+        split_bgra_avx2(src, channel);
+    }
+    else
+    {
+        split_bgr_avx2(lanes, src, channel);
+    }
+}
+
+template <int CHANNELS>
+__attribute__((target("avx2")))
+inline void merge_pixels_avx2(const BgrLanes256& lanes, const __m256i channel[4], uint8_t* dst)
+{
+    if (CHANNELS == 4)
+    {
+        merge_bgra_avx2(channel, dst);
+    }
+    else
+    {
+        merge_bgr_avx2(lanes, channel, dst);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void channel_sums_avx2(const __m256i channel[3], __m256i& lo, __m256i& hi)
+{
+    __m256i zero = _mm256_setzero_si256();
+    lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(channel[0], zero), _mm256_unpacklo_epi8(channel[1], zero)),
+                          _mm256_unpacklo_epi8(channel[2], zero));
+    hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(channel[0], zero), _mm256_unpackhi_epi8(channel[1], zero)),
+                          _mm256_unpackhi_epi8(channel[2], zero));
+}
+
+/**
+ * Applies a scale curve to 16 channel values with the same double-precision
+ * arithmetic as the scalar tables, keeping the low byte of each truncated result
+ * @param values  the channel values
+ * @param scale   the scaling factor in every lane
+ * @param lighten true for 255-(255-c)*scale, false for c*scale
+ * @return the new channel values
+ */
+__attribute__((target("avx2")))
+inline __m128i scale_curve_avx2(__m128i values, __m256d scale, bool lighten)
+{
+    const __m128i low_bytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i full = _mm256_set1_epi32(255);
+    const __m256d full_pd = _mm256_set1_pd(255);
+    __m128i quarter[4];
+    for (int half = 0; half < 2; half++)
+    {
+        __m256i c = _mm256_cvtepu8_epi32(half == 0 ? values : _mm_srli_si128(values, 8));
+        if (lighten)
+        {
+            c = _mm256_sub_epi32(full, c);
+        }
+        for (int part = 0; part < 2; part++)
+        {
+            __m256d x = _mm256_cvtepi32_pd(part == 0 ? _mm256_castsi256_si128(c) : _mm256_extracti128_si256(c, 1));
+            x = _mm256_mul_pd(x, scale);
+            if (lighten)
+            {
+                x = _mm256_sub_pd(full_pd, x);
+            }
+            quarter[2 * half + part] = _mm_shuffle_epi8(_mm256_cvttpd_epi32(x), low_bytes);
+        }
+    }
+    return _mm_unpacklo_epi64(_mm_unpacklo_epi32(quarter[0], quarter[1]), _mm_unpacklo_epi32(quarter[2], quarter[3]));
+}
+
+__attribute__((target("avx2")))
+inline __m256i scale_curve_avx2(__m256i values, __m256d scale, bool lighten)
+{
+    return _mm256_set_m128i(scale_curve_avx2(_mm256_extracti128_si256(values, 1), scale, lighten),
+                            scale_curve_avx2(_mm256_castsi256_si128(values), scale, lighten));
+}
+
+/**
+ * Applies the darken or lighten curve to 16 channel values, chosen per value
+ * The product is shared: darken is (int)(c*scale) and lighten is
+ * (int)(255-(255-c)*scale), so the multiplier input is c or 255-c and the
+ * lightened result is 255 minus the product, exactly as in the scalar tables.
+ * @param values  the channel values
+ * @param lighten 0xFF where the lighten curve applies, 0 where darken applies
+ * @param scale   the scaling factor in every lane
+ * @return the new channel values
+ */
+__attribute__((target("avx2")))
+inline __m128i clarendon_curve_avx2(__m128i values, __m128i lighten, __m256d scale)
+{
+    const __m128i low_bytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256d full_pd = _mm256_set1_pd(255);
+    __m128i input = _mm_blendv_epi8(values, _mm_sub_epi8(_mm_set1_epi8((char)255), values), lighten);
+    __m128i dark[4], light[4];
+    for (int half = 0; half < 2; half++)
+    {
+        __m256i c = _mm256_cvtepu8_epi32(half == 0 ? input : _mm_srli_si128(input, 8));
+        for (int part = 0; part < 2; part++)
+        {
+            __m256d x = _mm256_mul_pd(_mm256_cvtepi32_pd(part == 0 ? _mm256_castsi256_si128(c) : _mm256_extracti128_si256(c, 1)), scale);
+            dark[2 * half + part] = _mm_shuffle_epi8(_mm256_cvttpd_epi32(x), low_bytes);
+            light[2 * half + part] = _mm_shuffle_epi8(_mm256_cvttpd_epi32(_mm256_sub_pd(full_pd, x)), low_bytes);
+        }
+    }
+    __m128i darkened = _mm_unpacklo_epi64(_mm_unpacklo_epi32(dark[0], dark[1]), _mm_unpacklo_epi32(dark[2], dark[3]));
+    __m128i lightened = _mm_unpacklo_epi64(_mm_unpacklo_epi32(light[0], light[1]), _mm_unpacklo_epi32(light[2], light[3]));
+    return _mm_blendv_epi8(darkened, lightened, lighten);
+}
+
+// A fixed-point scale curve spread over 16-bit lanes
+struct FixedLanes256
+{
+    __m256i high;        // Upper 16 bits of the factor
+    __m256i low;         // Lower 16 bits of the factor
+    __m256i threshold;   // The rounding threshold with its sign bit flipped, for signed compares
+    __m256i cap;         // Whole parts above this never round up
+};
+
+/**
+ * Spreads a fixed-point curve over 16-bit lanes
+ * @param curve   the curve
+ * @param lighten true for the lighten curve, whose whole parts round up only below 255
+ * @return the curve in every lane
+ */
+__attribute__((target("avx2")))
+inline FixedLanes256 fixed_lanes_avx2(const FixedCurve& curve, bool lighten)
+{
+    return {_mm256_set1_epi16((short)(curve.factor >> 16)), _mm256_set1_epi16((short)(curve.factor & 0xFFFF)),
+            _mm256_set1_epi16((short)(curve.threshold ^ 0x8000)), _mm256_set1_epi16(lighten ? 254 : (short)0xFFFF)};
+}
+
+/**
+ * Applies the darken or lighten curve to 32 channel values in 16.16 fixed point
+ * Products are split as x*(factor>>16) + mulhi(x, factor&0xFFFF); the low
+ * product is the fraction, which decides whether the whole part rounds up.
+ * Results are exactly fixed_curve_value(), low byte kept.
+ * @param values  the channel values
+ * @param lighten 0xFF where the lighten curve applies, 0 where darken applies
+ * @param dark    the darken curve
+ * @param light   the lighten curve
+ * @return the new channel values
+ */
+__attribute__((target("avx2")))
+inline __m256i fixed_curve_avx2(__m256i values, __m256i lighten, const FixedLanes256& dark, const FixedLanes256& light)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(255);
+    const __m256i sign = _mm256_set1_epi16((short)0x8000);
+    const __m256i low_byte = _mm256_set1_epi16(0xFF);
+    __m256i input = _mm256_blendv_epi8(values, _mm256_sub_epi8(_mm256_set1_epi8((char)255), values), lighten);
+    __m256i result[2];
+    for (int half = 0; half < 2; half++)
+    {
+        __m256i x = half == 0 ? _mm256_unpacklo_epi8(input, zero) : _mm256_unpackhi_epi8(input, zero);
+        __m256i mask = half == 0 ? _mm256_unpacklo_epi8(lighten, lighten) : _mm256_unpackhi_epi8(lighten, lighten);
+        __m256i high = _mm256_blendv_epi8(dark.high, light.high, mask);
+        __m256i low = _mm256_blendv_epi8(dark.low, light.low, mask);
+        __m256i threshold = _mm256_blendv_epi8(dark.threshold, light.threshold, mask);
+        __m256i cap = _mm256_blendv_epi8(dark.cap, light.cap, mask);
+
+        __m256i whole = _mm256_add_epi16(_mm256_mullo_epi16(x, high), _mm256_mulhi_epu16(x, low));
+        __m256i fraction = _mm256_mullo_epi16(x, low);
+
+        // up is -1 where the fraction is above the threshold and the whole part is at most the cap
+        __m256i up = _mm256_and_si256(_mm256_cmpgt_epi16(_mm256_xor_si256(fraction, sign), threshold),
+                                      _mm256_cmpeq_epi16(_mm256_min_epu16(whole, cap), whole));
+        __m256i value = _mm256_sub_epi16(whole, up);
+        result[half] = _mm256_and_si256(_mm256_blendv_epi8(value, _mm256_sub_epi16(full, value), mask), low_byte);
+    }
+    return _mm256_packus_epi16(result[0], result[1]);
+}
+
+template <int CHANNELS>
+__attribute__((target("avx2")))
+int grayscale_avx2(uint8_t* pixels, int count, const PreparedOp&)
+{
+    static const BgrLanes256 lanes;
+    const __m256i third = _mm256_set1_epi16((short)0xAAAB);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i channel[4], lo, hi;
+        split_pixels_avx2<CHANNELS>(lanes, pixels + CHANNELS * i, channel);
+        channel_sums_avx2(channel, lo, hi);
+        lo = _mm256_srli_epi16(_mm256_mulhi_epu16(lo, third), 1);
+        hi = _mm256_srli_epi16(_mm256_mulhi_epu16(hi, third), 1);
+        channel[0] = channel[1] = channel[2] = _mm256_packus_epi16(lo, hi);
+        merge_pixels_avx2<CHANNELS>(lanes, channel, pixels + CHANNELS * i);
+    }
+    return i;
+}
+
+template <int CHANNELS>
+__attribute__((target("avx2")))
+int high_contrast_avx2(uint8_t* pixels, int count, const PreparedOp&)
+{
+    static const BgrLanes256 lanes;
+    const __m256i cut = _mm256_set1_epi16(3 * CONTRAST_CUT - 1);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i channel[4], lo, hi;
+        split_pixels_avx2<CHANNELS>(lanes, pixels + CHANNELS * i, channel);
+        channel_sums_avx2(channel, lo, hi);
+        channel[0] = channel[1] = channel[2] = _mm256_packs_epi16(_mm256_cmpgt_epi16(lo, cut), _mm256_cmpgt_epi16(hi, cut));
+        merge_pixels_avx2<CHANNELS>(lanes, channel, pixels + CHANNELS * i);
+    }
+    return i;
+}
+
+template <int CHANNELS>
+__attribute__((target("avx2")))
+int bwrgb_avx2(uint8_t* pixels, int count, const PreparedOp&)
+{
+    static const BgrLanes256 lanes;
+    const __m256i white_cut = _mm256_set1_epi16(BWRGB_WHITE_FROM - 1);
+    const __m256i black_cut = _mm256_set1_epi16(BWRGB_BLACK_UP_TO);
+    const __m256i sign = _mm256_set1_epi8((char)0x80);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i channel[4], lo, hi;
+        split_pixels_avx2<CHANNELS>(lanes, pixels + CHANNELS * i, channel);
+        channel_sums_avx2(channel, lo, hi);
+        __m256i white = _mm256_packs_epi16(_mm256_cmpgt_epi16(lo, white_cut), _mm256_cmpgt_epi16(hi, white_cut));
+        __m256i not_black = _mm256_packs_epi16(_mm256_cmpgt_epi16(lo, black_cut), _mm256_cmpgt_epi16(hi, black_cut));
+        __m256i color = _mm256_andnot_si256(white, not_black);
+
+        __m256i b = _mm256_xor_si256(channel[BLUE], sign);
+        __m256i g = _mm256_xor_si256(channel[GREEN], sign);
+        __m256i r = _mm256_xor_si256(channel[RED], sign);
+        __m256i red = _mm256_and_si256(_mm256_cmpgt_epi8(r, g), _mm256_cmpgt_epi8(r, b));
+        __m256i green = _mm256_and_si256(_mm256_cmpgt_epi8(g, b), _mm256_cmpgt_epi8(g, r));
+        __m256i blue = _mm256_andnot_si256(_mm256_or_si256(red, green), _mm256_set1_epi8(-1));
+
+        channel[RED] = _mm256_or_si256(white, _mm256_and_si256(color, red));
+        channel[GREEN] = _mm256_or_si256(white, _mm256_and_si256(color, green));
+        channel[BLUE] = _mm256_or_si256(white, _mm256_and_si256(color, blue));
+        merge_pixels_avx2<CHANNELS>(lanes, channel, pixels + CHANNELS * i);
+    }
+    return i;
+}
+
+template <int CHANNELS>
+__attribute__((target("avx2")))
+int clarendon_avx2(uint8_t* pixels, int count, const PreparedOp& op)
+{
+    static const BgrLanes256 lanes;
+    const __m256i lighten_cut = _mm256_set1_epi16(3 * CLARENDON_LIGHTEN_FROM - 1);
+    const __m256i darken_cut = _mm256_set1_epi16(3 * CLARENDON_DARKEN_BELOW);
+    const __m256d scale = _mm256_set1_pd(op.scaling_factor);
+    const bool fixed_point = op.fixed[CURVE_DARKEN].exact && op.fixed[CURVE_LIGHTEN].exact;
+    const FixedLanes256 dark = fixed_lanes_avx2(op.fixed[CURVE_DARKEN], false);
+    const FixedLanes256 light = fixed_lanes_avx2(op.fixed[CURVE_LIGHTEN], true);
+    int i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i channel[4], lo, hi;
+        split_pixels_avx2<CHANNELS>(lanes, pixels + CHANNELS * i, channel);
+        channel_sums_avx2(channel, lo, hi);
+        __m256i lighten = _mm256_packs_epi16(_mm256_cmpgt_epi16(lo, lighten_cut), _mm256_cmpgt_epi16(hi, lighten_cut));
+        __m256i darken = _mm256_packs_epi16(_mm256_cmpgt_epi16(darken_cut, lo), _mm256_cmpgt_epi16(darken_cut, hi));
+        if (_mm256_testz_si256(_mm256_or_si256(lighten, darken), _mm256_set1_epi8(-1)))
+        {
+            continue;
+        }
+
+        __m256i change = _mm256_or_si256(lighten, darken);
+        for (int a = 0; a < 3; a++)
+        {
+            if (fixed_point)
+            {
+                channel[a] = _mm256_blendv_epi8(channel[a], fixed_curve_avx2(channel[a], lighten, dark, light), change);
+                continue;
+            }
+            __m128i low = clarendon_curve_avx2(_mm256_castsi256_si128(channel[a]), _mm256_castsi256_si128(lighten), scale);
+            __m128i high = clarendon_curve_avx2(_mm256_extracti128_si256(channel[a], 1), _mm256_extracti128_si256(lighten, 1), scale);
+            channel[a] = _mm256_blendv_epi8(channel[a], _mm256_set_m128i(high, low), change);
+        }
+        merge_pixels_avx2<CHANNELS>(lanes, channel, pixels + CHANNELS * i);
+    }
+    return i;
+}
+
+/**
+ * Applies a scale curve to every colour byte of a run
+ * All three channels share the curve, so the bytes need no splitting; BGRA
+ * alpha bytes are blended back unchanged. Curves with an exact fixed-point
+ * version use 16-bit integer lanes instead of doubles.
+ */
+template <int CHANNELS>
+__attribute__((target("avx2")))
+inline int scale_curve_run_avx2(uint8_t* pixels, int count, const PreparedOp& op, bool lighten)
+{
+    const __m256d scale = _mm256_set1_pd(op.scaling_factor);
+    const FixedCurve& fixed = op.fixed[lighten ? CURVE_LIGHTEN : CURVE_DARKEN];
+    const FixedLanes256 lanes = fixed_lanes_avx2(fixed, lighten);
+    const __m256i curve = _mm256_set1_epi8(lighten ? -1 : 0);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    int bytes = CHANNELS * count;
+    int i = 0;
+    // Whole pixels only: three vectors hold exactly 32 BGR or 24 BGRA pixels
+    for (; i + 96 <= bytes; i += 96)
+    {
+        for (int k = i; k < i + 96; k += 32)
+        {
+            __m256i values = _mm256_loadu_si256((const __m256i*)(pixels + k));
+            __m256i result = fixed.exact ? fixed_curve_avx2(values, curve, lanes, lanes)
+                                         : scale_curve_avx2(values, scale, lighten);
+            if (CHANNELS == 4)
+            {
+                result = _mm256_blendv_epi8(result, values, alpha);
+            }
+            _mm256_storeu_si256((__m256i*)(pixels + k), result);
+        }
+    }
+    return i / CHANNELS;
+}
+
+template <int CHANNELS>
+__attribute__((target("avx2")))
+int lighten_avx2(uint8_t* pixels, int count, const PreparedOp& op)
+{
+    return scale_curve_run_avx2<CHANNELS>(pixels, count, op, true);
+}
+
+template <int CHANNELS>
+__attribute__((target("avx2")))
+int darken_avx2(uint8_t* pixels, int count, const PreparedOp& op)
+{
+    return scale_curve_run_avx2<CHANNELS>(pixels, count, op, false);
+}
+
+/**
+ * Maps every colour byte of a run through a 256-entry table held in four registers
+ * BGRA alpha bytes are masked out of the stores.
+ * @param pixels the run to change
+ * @param count  number of pixels in the run
+ * @param table  the channel table
+ * @return the number of pixels handled
+ */
+template <int CHANNELS>
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+inline int table_run_avx512(uint8_t* pixels, int count, const uint8_t table[256])
+{
+    __m512i t0 = _mm512_loadu_si512(table);
+    __m512i t1 = _mm512_loadu_si512(table + 64);
+    __m512i t2 = _mm512_loadu_si512(table + 128);
+    __m512i t3 = _mm512_loadu_si512(table + 192);
+    const __mmask64 colour_bytes = 0x7777777777777777ULL;
+    int bytes = CHANNELS * count;
+    int i = 0;
+    // Whole pixels only: three vectors hold exactly 64 BGR or 48 BGRA pixels
+    for (; i + 192 <= bytes; i += 192)
+    {
+        for (int k = i; k < i + 192; k += 64)
+        {
+            __m512i values = _mm512_loadu_si512(pixels + k);
+            __m512i low = _mm512_permutex2var_epi8(t0, values, t1);
+            __m512i high = _mm512_permutex2var_epi8(t2, values, t3);
+            __m512i result = _mm512_mask_blend_epi8(_mm512_movepi8_mask(values), low, high);
+            if (CHANNELS == 4)
+            {
+                _mm512_mask_storeu_epi8(pixels + k, colour_bytes, result);
+            }
+            else
+            {
+                _mm512_storeu_si512(pixels + k, result);
+            }
+        }
+    }
+    return i / CHANNELS;
+}
+
+template <int CHANNELS>
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+int lighten_avx512(uint8_t* pixels, int count, const PreparedOp& op)
+{
+    return table_run_avx512<CHANNELS>(pixels, count, op.curves[CURVE_LIGHTEN]);
+}
+
+template <int CHANNELS>
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+int darken_avx512(uint8_t* pixels, int count, const PreparedOp& op)
+{
+    return table_run_avx512<CHANNELS>(pixels, count, op.curves[CURVE_DARKEN]);
+}
+
+/**
+ * Vignette for BGR runs, four pixels at a time
+ * Squares, sums, square roots and the division are the same correctly rounded
+ * double operations as VignetteFilter, so results are identical.
+ */
+__attribute__((target("avx2")))
+int vignette_avx2(const RowSpan& span)
+{
+    const __m128i low_bytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256d rows = _mm256_set1_pd(span.num_rows);
+    const __m256d steps = _mm256_setr_pd(0, 1, 2, 3);
+    double dy = span.y - (span.num_rows/2);
+    const __m256d dy_squared = _mm256_set1_pd(dy * dy);
+    double dx = span.x - (span.num_columns/2);
+
+    // 16-byte loads read two pixels ahead, so stop while they stay inside the run
+    int i = 0;
+    for (; i + 6 <= span.count; i += 4, dx += 4)
+    {
+        __m256d x = _mm256_add_pd(_mm256_set1_pd(dx), steps);
+        __m256d distance = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(x, x), dy_squared));
+        __m256d scale = _mm256_div_pd(_mm256_sub_pd(rows, distance), rows);
+
+        // Scales for bytes 0-3, 4-7 and 8-11: pixels 0001, 1122 and 2333
+        uint8_t* px = span.pixels + 3 * i;
+        __m128i bytes = _mm_loadu_si128((const __m128i*)px);
+        __m128i part0 = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(bytes)),
+                                                          _mm256_permute4x64_pd(scale, 0x40)));
+        __m128i part1 = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4))),
+                                                          _mm256_permute4x64_pd(scale, 0xA5)));
+        __m128i part2 = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8))),
+                                                          _mm256_permute4x64_pd(scale, 0xFE)));
+        __m128i out = _mm_unpacklo_epi32(_mm_shuffle_epi8(part0, low_bytes), _mm_shuffle_epi8(part1, low_bytes));
+        _mm_storel_epi64((__m128i*)px, out);
+        int last = _mm_cvtsi128_si32(_mm_shuffle_epi8(part2, low_bytes));
+        memcpy(px + 8, &last, 4);
+    }
+    return i;
+}
+
+/**
+ * Vignette for BGRA runs, four pixels at a time
+ * Each pixel is one 16-byte lane group scaled as four doubles, alpha included;
+ * the original alpha bytes are then blended back.
+ */
+__attribute__((target("avx2")))
+int vignette_bgra_avx2(const RowSpan& span)
+{
+    const __m128i low_bytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    const __m256d rows = _mm256_set1_pd(span.num_rows);
+    const __m256d steps = _mm256_setr_pd(0, 1, 2, 3);
+    double dy = span.y - (span.num_rows/2);
+    const __m256d dy_squared = _mm256_set1_pd(dy * dy);
+    double dx = span.x - (span.num_columns/2);
+
+    int i = 0;
+    for (; i + 4 <= span.count; i += 4, dx += 4)
+    {
+        __m256d x = _mm256_add_pd(_mm256_set1_pd(dx), steps);
+        __m256d distance = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(x, x), dy_squared));
+        __m256d scale = _mm256_div_pd(_mm256_sub_pd(rows, distance), rows);
+
+        uint8_t* px = span.pixels + 4 * i;
+        __m128i bytes = _mm_loadu_si128((const __m128i*)px);
+        __m128i part[4];
+        part[0] = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(bytes)),
+                                                    _mm256_permute4x64_pd(scale, 0x00)));
+        part[1] = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4))),
+                                                    _mm256_permute4x64_pd(scale, 0x55)));
+        part[2] = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 8))),
+                                                    _mm256_permute4x64_pd(scale, 0xAA)));
+        part[3] = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 12))),
+                                                    _mm256_permute4x64_pd(scale, 0xFF)));
+        __m128i out = _mm_unpacklo_epi64(_mm_unpacklo_epi32(_mm_shuffle_epi8(part[0], low_bytes), _mm_shuffle_epi8(part[1], low_bytes)),
+                                         _mm_unpacklo_epi32(_mm_shuffle_epi8(part[2], low_bytes), _mm_shuffle_epi8(part[3], low_bytes)));
+        _mm_storeu_si128((__m128i*)px, _mm_blendv_epi8(out, bytes, alpha));
+    }
+    return i;
+}
+
+#endif
+
+/**
+ * Picks the fastest kernels this CPU supports for one pixel layout
+ * The IMGPROC_SIMD environment variable (scalar, sse4.1, avx2 or avx512) caps
+ * the level, which is useful for comparing results between kernels.
+ * @tparam CHANNELS bytes per pixel, 3 for BGR or 4 for BGRA
+ * @return the kernel set
+ */
+template <int CHANNELS>
+KernelSet select_kernels()
+{
+    KernelSet kernels;
+#if defined(__x86_64__) || defined(__i386__)
+    const char* cap = getenv("IMGPROC_SIMD");
+    string limit = cap != nullptr ? cap : "avx512";
+    int level = limit == "scalar" ? 0 : limit == "sse4.1" ? 1 : limit == "avx2" ? 2 : 3;
+
+    __builtin_cpu_init();
+    if (level >= 1 && __builtin_cpu_supports("sse4.1"))
+    {
+        kernels.name = "sse4.1";
+        kernels.grayscale = grayscale_sse41<CHANNELS>;
+        kernels.high_contrast = high_contrast_sse41<CHANNELS>;
+        kernels.bwrgb = bwrgb_sse41<CHANNELS>;
+    }
+    if (level >= 2 && __builtin_cpu_supports("avx2"))
+    {
+        kernels.name = "avx2";
+        kernels.vignette = CHANNELS == 4 ? vignette_bgra_avx2 : vignette_avx2;
+        kernels.clarendon = clarendon_avx2<CHANNELS>;
+        kernels.grayscale = grayscale_avx2<CHANNELS>;
+        kernels.high_contrast = high_contrast_avx2<CHANNELS>;
+        kernels.lighten = lighten_avx2<CHANNELS>;
+        kernels.darken = darken_avx2<CHANNELS>;
+        kernels.bwrgb = bwrgb_avx2<CHANNELS>;
+    }
+    if (level >= 3 && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi"))
+    {
+        kernels.name = "avx512";
+        kernels.lighten = lighten_avx512<CHANNELS>;
+        kernels.darken = darken_avx512<CHANNELS>;
+    }
+#endif
+    return kernels;
+}
+
+/**
+ * Gets the kernels chosen for this CPU, selecting them on first use
+ * @param channels bytes per pixel of the image being filtered
+ * @return the kernel set
+ */
+const KernelSet& active_kernels(int channels = 3)
+{
+    static const KernelSet bgr_kernels = select_kernels<3>();
+    static const KernelSet bgra_kernels = select_kernels<4>();
+    return channels == 4 ? bgra_kernels : bgr_kernels;
+}
+
+/**
+ * Runs a vector kernel over the start of a run, if there is one
+ * @param kernel the kernel, or null
+ * @param op     the filter being applied
+ * @param span   the pixels to change
+ * @return the rest of the run, for the scalar kernel to finish
+ */
+RowSpan run_simd_kernel(SpanKernel kernel, const PreparedOp& op, const RowSpan& span)
+{
+    RowSpan rest = span;
+    if (kernel != nullptr)
+    {
+        int done = kernel(span.pixels, span.count, op);
+        rest.pixels += (size_t)done * span.channels;
+        rest.x += done;
+        rest.count -= done;
+    }
+    return rest;
+}
+
+/**
+ * Applies a prepared point filter in place to a run of pixels
+ * @param op   the filter to apply
+ * @param span the pixels to change
+ */
+void apply_prepared_op(const PreparedOp& op, const RowSpan& span)
+{
+    const KernelSet& kernels = active_kernels(span.channels);
+    switch (op.process)
+    {
+        case 1:
+        {
+            RowSpan rest = span;
+            if (kernels.vignette != nullptr)
+            {
+                int done = kernels.vignette(span);
+                rest.pixels += (size_t)done * span.channels;
+                rest.x += done;
+                rest.count -= done;
+            }
+            apply_pixel_filter(rest, VignetteFilter(rest));
+            break;
+        }
+        case 2: apply_pixel_filter(run_simd_kernel(kernels.clarendon, op, span), ClarendonFilter{op.curves}); break;
+        case 3: apply_pixel_filter(run_simd_kernel(kernels.grayscale, op, span), SumLutFilter{SUM_TABLES.grey}); break;
+        case 7: apply_pixel_filter(run_simd_kernel(kernels.high_contrast, op, span), SumLutFilter{SUM_TABLES.contrast}); break;
+        case 8: apply_pixel_filter(run_simd_kernel(kernels.lighten, op, span), ChannelLutFilter{op.curves[CURVE_LIGHTEN]}); break;
+        case 9: apply_pixel_filter(run_simd_kernel(kernels.darken, op, span), ChannelLutFilter{op.curves[CURVE_DARKEN]}); break;
+        case 10: apply_pixel_filter(run_simd_kernel(kernels.bwrgb, op, span), BwrgbFilter{}); break;
+    }
+}
+
+/**
+ * Builds the lookup tables for every filter in a chain
+ * @param chain the filters, in order
+ * @return the filters ready to apply
+ */
+vector<PreparedOp> prepare_point_chain(const vector<PointOp>& chain)
+{
+    vector<PreparedOp> prepared;
+    for (const PointOp& op : chain)
+    {
+        prepared.push_back(prepare_point_op(op));
+    }
+    return prepared;
+}
+
+// Chained filters run over pieces of a row short enough to stay in the L1 cache
+const int FUSED_SPAN_PIXELS = 1024;
+
+/**
+ * Applies a chain of point filters in place to a run of pixels in one pass
+ * Every filter in the chain runs over a short piece of the run before moving
+ * on to the next piece, so each pixel is fetched from memory once and no
+ * intermediate image exists. The result is identical to applying the filters
+ * one after another.
+ * @param chain the prepared filters to apply, in order
+ * @param span  the pixels to change
+ */
+void apply_point_chain(const vector<PreparedOp>& chain, const RowSpan& span)
+{
+    RowSpan piece = span;
+    for (int start = 0; start < span.count; start += FUSED_SPAN_PIXELS)
+    {
+        piece.pixels = span.pixels + (size_t)start * span.channels;
+        piece.x = span.x + start;
+        piece.count = min(FUSED_SPAN_PIXELS, span.count - start);
+        for (const PreparedOp& op : chain)
+        {
+            apply_prepared_op(op, piece);
+        }
+    }
+}
+
+/**
+ * Applies a chain of point filters in place to every row of an image
+ * @param chain the filters to apply, in order
+ * @param image the image to change
+ */
+void apply_point_chain(const vector<PointOp>& chain, Image& image)
+{
+    vector<PreparedOp> prepared = prepare_point_chain(chain);
+    parallel_rows(image.height, [&](int begin, int end) {
+        RowSpan span;
+        span.count = image.width;
+        span.channels = image.channels;
+        span.num_columns = image.width;
+        span.num_rows = image.height;
+        for (int row = begin; row < end; row++)
+        {
+            span.pixels = image.row(row);
+            span.y = row;
+            apply_point_chain(prepared, span);
+        }
+    });
+}
+
+/**
+ * Applies a point filter in place to every row of an image
+ * @param op    the filter to apply
+ * @param image the image to change
+ */
+void apply_point_op(const PointOp& op, Image& image)
+{
+    apply_point_chain({op}, image);
+}
+
+/**
+ * Runs a chain of point filters over an image in a single traversal
+ * @param image the input image
+ * @param chain the filters to apply, in order
+ * @return the filtered image
+ */
+Image process_chain(const Image& image, const vector<PointOp>& chain)
+{
+    Image new_image = clone_image(image);
+    apply_point_chain(chain, new_image);
+    return new_image;
+}
+
+//***************************************************************************************************//
+//                                        ROTATION KERNELS                                           //
+//***************************************************************************************************//
+
+// Quarter turns copy square tiles of this many pixels, small enough that the
+// source rows a tile touches stay in the L1 cache while it is written
+const int ROTATE_TILE = 64;
+
+/**
+ * Copies one pixel
+ * @param dst      destination pixel
+ * @param src      source pixel
+ * @param channels bytes per pixel
+ */
+inline void copy_pixel(uint8_t* dst, const uint8_t* src, int channels)
+{
+    if (channels == 4)
+    {
+        memcpy(dst, src, 4);
+    }
+    else
+    {
+        memcpy(dst, src, 3);
+    }
+}
+
+/**
+ * Rotates an image a quarter turn into caller-owned storage, one tile at a time
+ * Clockwise, output pixel (i, j) is source pixel (height-1-j, i); counter-clockwise
+ * it is source pixel (j, width-1-i). BGRA tiles move as 4x4 register transposes.
+ * @param image     the source image
+ * @param clockwise the direction to turn
+ * @param new_image receives the rotated image; must not be the source
+ * @return true if the image was rotated
+ */
+bool rotate_quarter_into(const Image& image, bool clockwise, Image& new_image)
+{
+    int num_rows = image.height;
+    int num_columns = image.width;
+    int channels = image.channels;
+    if (&new_image == &image || !reshape_image(new_image, num_rows, num_columns, channels))
+    {
+        return false;
+    }
+
+    int tile_rows = (num_columns + ROTATE_TILE - 1) / ROTATE_TILE;
+    parallel_rows(tile_rows, [&](int begin, int end) {
+        for (int i0 = begin * ROTATE_TILE; i0 < min(end * ROTATE_TILE, num_columns); i0 += ROTATE_TILE)
+        {
+            int i1 = min(i0 + ROTATE_TILE, num_columns);
+            for (int j0 = 0; j0 < num_rows; j0 += ROTATE_TILE)
+            {
+                int j1 = min(j0 + ROTATE_TILE, num_rows);
+                int i = i0;
+#if defined(__x86_64__) || defined(__i386__)
+                if (channels == 4)
+                {
+                    for (; i + 4 <= i1; i += 4)
+                    {
+                        int j = j0;
+                        for (; j + 4 <= j1; j += 4)
+                        {
+                            __m128i rows[4];
+                            for (int k = 0; k < 4; k++)
+                            {
+                                const uint8_t* src = clockwise ? image.row(num_rows - 1 - (j + k)) + i * 4
+                                                               : image.row(j + k) + (num_columns - 4 - i) * 4;
+                                rows[k] = _mm_loadu_si128((const __m128i*)src);
+                            }
+                            transpose_4x4(rows);
+                            for (int m = 0; m < 4; m++)
+                            {
+                                // Counter-clockwise, the leftmost source column lands on the bottom row
+                                __m128i out = clockwise ? rows[m] : rows[3 - m];
+                                _mm_storeu_si128((__m128i*)(new_image.row(i + m) + j * 4), out);
+                            }
+                        }
+                        for (; j < j1; j++)
+                        {
+                            for (int m = 0; m < 4; m++)
+                            {
+                                const uint8_t* src = clockwise ? image.row(num_rows - 1 - j) + (i + m) * 4
+                                                               : image.row(j) + (num_columns - 1 - (i + m)) * 4;
+                                copy_pixel(new_image.row(i + m) + j * 4, src, 4);
+                            }
+                        }
+                    }
+                }
+#endif
+                for (; i < i1; i++)
+                {
+                    uint8_t* dst = new_image.row(i);
+                    for (int j = j0; j < j1; j++)
+                    {
+                        const uint8_t* src = clockwise ? image.row(num_rows - 1 - j) + i * channels
+                                                       : image.row(j) + (num_columns - 1 - i) * channels;
+                        copy_pixel(dst + j * channels, src, channels);
+                    }
+                }
+            }
+        }
+    }, 1);
+
+    return true;
+}
+
+/**
+ * Rotates an image a quarter turn
+ * @param image     the source image
+ * @param clockwise the direction to turn
+ * @return the rotated image
+ */
+Image rotate_quarter(const Image& image, bool clockwise)
+{
+    Image new_image;
+    rotate_quarter_into(image, clockwise, new_image);
+    return new_image;
+}
+
+/**
+ * Rotates an image 90 degrees clockwise
+ * @param image the source image
+ * @return the rotated image
+ */
+Image rotate_90(const Image& image)
+{
+    return rotate_quarter(image, true);
+}
+
+/**
+ * Rotates an image 270 degrees clockwise in a single pass
+ * @param image the source image
+ * @return the rotated image
+ */
+Image rotate_270(const Image& image)
+{
+    return rotate_quarter(image, false);
+}
+
+/**
+ * Copies a row into another with its pixels in reverse order
+ * @param dst      the destination row
+ * @param src      the source row; must not overlap dst
+ * @param width    pixels in the row
+ * @param channels bytes per pixel
+ */
+void reverse_row(uint8_t* dst, const uint8_t* src, int width, int channels)
+{
+    const uint8_t* px = src + (size_t)(width - 1) * channels;
+    for (int x = 0; x < width; x++, px -= channels, dst += channels)
+    {
+        copy_pixel(dst, px, channels);
+    }
+}
+
+/**
+ * Rotates an image 180 degrees into caller-owned storage in a single pass
+ * Output row i is source row height-1-i reversed, so both images are read and
+ * written sequentially.
+ * @param image     the source image
+ * @param new_image receives the rotated image; must not be the source
+ * @return true if the image was rotated
+ */
+bool rotate_180_into(const Image& image, Image& new_image)
+{
+    if (&new_image == &image || !reshape_image(new_image, image.width, image.height, image.channels))
+    {
+        return false;
+    }
+
+    parallel_rows(image.height, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            reverse_row(new_image.row(i), image.row(image.height - 1 - i), image.width, image.channels);
+        }
+    });
+    return true;
+}
+
+/**
+ * Rotates an image 180 degrees in a single pass
+ * @param image the source image
+ * @return the rotated image
+ */
+Image rotate_180(const Image& image)
+{
+    Image new_image;
+    rotate_180_into(image, new_image);
+    return new_image;
+}
+
+/**
+ * Swaps two rows while reversing the order of their pixels
+ * Passing the same row twice reverses it in place.
+ * @param upper    one row
+ * @param lower    the other row
+ * @param width    pixels in a row
+ * @param channels bytes per pixel
+ */
+void swap_reversed_rows(uint8_t* upper, uint8_t* lower, int width, int channels)
+{
+    // A row swapped with itself only needs its first half visited
+    int count = upper == lower ? width / 2 : width;
+    uint8_t* a = upper;
+    uint8_t* b = lower + (size_t)(width - 1) * channels;
+    for (int x = 0; x < count; x++, a += channels, b -= channels)
+    {
+        uint8_t held[4];
+        copy_pixel(held, a, channels);
+        copy_pixel(a, b, channels);
+        copy_pixel(b, held, channels);
+    }
+}
+
+/**
+ * Rotates an image 180 degrees without a second image buffer
+ * Rows are swapped in mirrored pairs, reversing their pixels on the way.
+ * @param image the image to rotate
+ */
+void rotate_180_in_place(Image& image)
+{
+    if (image.empty())
+    {
+        return;
+    }
+
+    int pairs = (image.height + 1) / 2;
+    parallel_rows(pairs, [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            swap_reversed_rows(image.row(i), image.row(image.height - 1 - i), image.width, image.channels);
+        }
+    });
+}
+
+//***************************************************************************************************//
+//                                         SCALING KERNELS                                           //
+//***************************************************************************************************//
+
+/**
+ * Maps every position of a scaled axis to its nearest source position
+ * Output position i samples source position floor(i / scale), so whole number
+ * scales replicate each source position exactly scale times.
+ * @param size  the number of source positions
+ * @param scale the scaling factor, which need not be a whole number
+ * @return the source position of each output position, or an empty list if
+ *         the scale is not positive or the result would be empty or too large
+ */
+vector<int> scale_map(int size, double scale)
+{
+    double scaled = floor(size * scale);
+    if (size <= 0 || !(scale > 0) || scaled < 1 || scaled > INT_MAX)
+    {
+        return {};
+    }
+
+    vector<int> map((int)scaled);
+    int whole = (int)scale;
+    for (int i = 0; i < (int)map.size(); i++)
+    {
+        // Integer division keeps whole number scales identical to the original enlarge
+        map[i] = whole == scale ? i / whole : min(size - 1, (int)(i / scale));
+    }
+    return map;
+}
+
+/**
+ * Converts a column map into byte offsets within a source row
+ * @param map      the source column of every output column
+ * @param channels bytes per source pixel
+ * @return the offset of the source pixel of every output column
+ */
+vector<uint32_t> pixel_offsets(const vector<int>& map, int channels)
+{
+    vector<uint32_t> offsets(map.size());
+    for (size_t i = 0; i < map.size(); i++)
+    {
+        offsets[i] = (uint32_t)map[i] * channels;
+    }
+    return offsets;
+}
+
+/**
+ * Expands one row horizontally by copying the mapped source pixel of every output column
+ * Pixels are moved as single 4-byte words that overlap the next output pixel,
+ * which is overwritten straight after; only the pixels where that word would
+ * run past the end of either row fall back to a byte copy.
+ * @param src       the source row
+ * @param src_bytes the number of readable bytes in the source row
+ * @param offsets   the source offset of every output column
+ * @param count     the number of output columns
+ * @param step      bytes per output pixel, 3 or 4 and at most bytes per source pixel
+ * @param dst       receives count * step bytes
+ */
+void replicate_row(const uint8_t* src, size_t src_bytes, const uint32_t* offsets, int count, int step, uint8_t* dst)
+{
+    int i = 0;
+    for (; i < count - 1 && offsets[i] + 4 <= src_bytes; i++)
+    {
+        uint32_t word;
+        memcpy(&word, src + offsets[i], 4);
+        memcpy(dst + (size_t)i * step, &word, 4);
+    }
+    for (; i < count; i++)
+    {
+        memcpy(dst + (size_t)i * step, src + offsets[i], step);
+    }
+}
+
+/**
+ * Expands one BGR row horizontally into BGRA pixels with an opaque alpha channel
+ * @param src     the source row
+ * @param offsets the source offset of every output column
+ * @param count   the number of output columns
+ * @param dst     receives count * 4 bytes
+ */
+void widen_row(const uint8_t* src, const uint32_t* offsets, int count, uint8_t* dst)
+{
+    for (int i = 0; i < count; i++, dst += 4)
+    {
+        memcpy(dst, src + offsets[i], 3);
+        dst[ALPHA] = 255;
+    }
+}
+
+/**
+ * Writes a scaled 24 or 32-bit BMP whose source rows are supplied on demand
+ * Each source row is expanded horizontally once into a block of scanlines and
+ * then handed to writev() once for every output row that repeats it, so the
+ * output image is never stored. Source rows are requested in file order
+ * (bottom to top), which lets a caller read them sequentially from disk.
+ * @param fd             the file to write to
+ * @param channels       bytes per source pixel
+ * @param bits_per_pixel depth of the file, 24 or 32
+ * @param x_map          the source column of every output column
+ * @param y_map          the source row of every output row
+ * @param source_row     returns the pixels of the given source row
+ * @param bytes          if not null, receives the number of bytes written
+ * @return true if everything was written
+ */
+bool write_scaled(int fd, int channels, int bits_per_pixel, const vector<int>& x_map, const vector<int>& y_map,
+                  const function<const uint8_t*(int)>& source_row, uint64_t* bytes = nullptr)
+{
+    int width = x_map.size();
+    int height = y_map.size();
+    int step = bits_per_pixel / 8;
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+    uint64_t array_bytes;
+    if (!make_bmp_header(header, width, height, bits_per_pixel, array_bytes))
+    {
+        return false;
+    }
+
+    vector<uint32_t> offsets = pixel_offsets(x_map, channels);
+    size_t src_bytes = (size_t)(x_map.back() + 1) * channels;
+    size_t pixel_bytes = (size_t)width * step;
+    size_t row_bytes = (pixel_bytes + 3) / 4 * 4;
+    int rows_per_block = max<size_t>(1, READ_BLOCK_SIZE / row_bytes);
+    vector<uint8_t> block(rows_per_block * row_bytes);
+
+    vector<struct iovec> iov;
+    iov.reserve(MAX_WRITE_VECTORS);
+    iov.push_back({header, sizeof(header)});
+    int used = 0;
+    int current = -1;
+    bool success = true;
+
+    for (int h = height - 1; h >= 0 && success; h--)
+    {
+        if (used == rows_per_block || (int)iov.size() == MAX_WRITE_VECTORS)
+        {
+            success = write_all(fd, iov.data(), iov.size());
+            iov.clear();
+            used = 0;
+            current = -1;
+        }
+        if (y_map[h] != current)
+        {
+            current = y_map[h];
+            uint8_t* dst = block.data() + used * row_bytes;
+            if (step <= channels)
+            {
+                replicate_row(source_row(current), src_bytes, offsets.data(), width, step, dst);
+            }
+            else
+            {
+                widen_row(source_row(current), offsets.data(), width, dst);
+            }
+            memset(dst + pixel_bytes, 0, row_bytes - pixel_bytes);
+            used++;
+        }
+        iov.push_back({block.data() + (used - 1) * row_bytes, row_bytes});
+    }
+    success = success && write_all(fd, iov.data(), iov.size());
+
+    if (bytes != nullptr)
+    {
+        *bytes = success ? sizeof(header) + array_bytes : 0;
+    }
+    return success;
+}
+
+/**
+ * Enlarges an image straight into a BMP file without building the output image
+ * @param filename       the BMP file name to save the enlarged image to
+ * @param image          the image to enlarge
+ * @param x_scale        the horizontal scaling factor, which need not be a whole number
+ * @param y_scale        the vertical scaling factor, which need not be a whole number
+ * @param stats          if not null, receives the bytes written and elapsed time
+ * @param bits_per_pixel depth of the file: 24, 32, or 0 to match the image
+ * @return true if successful and false otherwise
+ */
+bool write_enlarged_bmp(const string& filename, const Image& image, double x_scale, double y_scale,
+                        IoStats* stats = nullptr, int bits_per_pixel = 24)
+{
+    vector<int> x_map = scale_map(image.width, x_scale);
+    vector<int> y_map = scale_map(image.height, y_scale);
+    if (bits_per_pixel == 0)
+    {
+        bits_per_pixel = image.channels * 8;
+    }
+    if (image.empty() || x_map.empty() || y_map.empty() || (bits_per_pixel != 24 && bits_per_pixel != 32))
+    {
+        return false;
+    }
+    StageTimer timer(STAGE_ENLARGE, (uint64_t)x_map.size() * y_map.size());
+    auto start_time = chrono::steady_clock::now();
+
+    string temporary;
+    int fd = create_output(filename, temporary);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    uint64_t bytes = 0;
+    bool success = write_scaled(fd, image.channels, bits_per_pixel, x_map, y_map,
+                                [&](int y) { return (const uint8_t*)image.row(y); }, &bytes);
+    success = replace_output(fd, temporary, filename, success);
+    timer.add_bytes_written(bytes);
+    if (stats != nullptr)
+    {
+        stats->bytes = bytes;
+        stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    }
+    return success;
+}
+
+/**
+ * Halves a range of rows of an image by averaging each 2x2 block of pixels
+ * @param image the image to halve
+ * @param half  the halved image, already shaped
+ * @param begin the first row of half to produce
+ * @param end   one past the last row of half to produce
+ */
+template <int CHANNELS>
+void halve_rows(const Image& image, Image& half, int begin, int end)
+{
+    // An odd last column is paired with itself
+    int pairs = image.width / 2;
+    for (int y = begin; y < end; y++)
+    {
+        const uint8_t* top = image.row(2 * y);
+        const uint8_t* bottom = image.row(min(2 * y + 1, image.height - 1));
+        uint8_t* out = half.row(y);
+        for (int x = 0; x < pairs; x++)
+        {
+            const uint8_t* t = top + 2 * x * CHANNELS;
+            const uint8_t* b = bottom + 2 * x * CHANNELS;
+            for (int c = 0; c < CHANNELS; c++)
+            {
+                out[x * CHANNELS + c] = (t[c] + t[c + CHANNELS] + b[c] + b[c + CHANNELS] + 2) >> 2;
+            }
+        }
+        if (pairs < half.width)
+        {
+            const uint8_t* t = top + 2 * pairs * CHANNELS;
+            const uint8_t* b = bottom + 2 * pairs * CHANNELS;
+            for (int c = 0; c < CHANNELS; c++)
+            {
+                out[pairs * CHANNELS + c] = (2 * t[c] + 2 * b[c] + 2) >> 2;
+            }
+        }
+    }
+}
+
+/**
+ * Halves an image in both directions by averaging each 2x2 block of pixels
+ * An odd last row or column is averaged with itself, so every source pixel
+ * contributes and the result is (width + 1) / 2 by (height + 1) / 2.
+ * @param image the image to halve
+ * @param half  receives the halved image; its buffer is reused if large enough
+ * @return true if the halved image was made
+ */
+bool halve_image_into(const Image& image, Image& half)
+{
+    if (image.empty() || !reshape_image(half, (image.width + 1) / 2, (image.height + 1) / 2, image.channels))
+    {
+        return false;
+    }
+    parallel_rows(half.height, [&](int begin, int end) {
+        if (image.channels == 4)
+        {
+            halve_rows<4>(image, half, begin, end);
+        }
+        else
+        {
+            halve_rows<3>(image, half, begin, end);
+        }
+    });
+    return true;
+}
+
+//***************************************************************************************************//
+//                                          IMAGE FILTERS                                            //
+//***************************************************************************************************//
+
+Image process_1(const Image& image)
+{
+    StageTimer timer(STAGE_PROCESS_1, (uint64_t)image.width * image.height);
+    Image new_image = clone_image(image);
+    apply_point_op({1, 0}, new_image);
+    return new_image;
+}
+
+Image process_2(const Image& image, double scaling_factor)
+{
+    StageTimer timer(STAGE_PROCESS_1 + 1, (uint64_t)image.width * image.height);
+    Image new_image = clone_image(image);
+    apply_point_op({2, scaling_factor}, new_image);
+    return new_image;
+}
+
+Image process_3(const Image& image)
+{
+    StageTimer timer(STAGE_PROCESS_1 + 2, (uint64_t)image.width * image.height);
+    Image new_image = clone_image(image);
+    apply_point_op({3, 0}, new_image);
+    return new_image;
+}
+
+/**
+ * Rotates an image 90 degrees clockwise into caller-owned storage
+ * @param image the source image
+ * @param dst   receives the rotated image; its buffer is reused if large enough
+ * @return true if the image was rotated
+ */
+bool process_4_into(const Image& image, Image& dst){
+    StageTimer timer(STAGE_PROCESS_1 + 3, (uint64_t)image.width * image.height);
+    return rotate_quarter_into(image, true, dst);
+}
+
+Image process_4(const Image& image)
+{
+    Image new_image;
+    process_4_into(image, new_image);
+    return new_image;
+}
+
+Image rotateby90(const Image& image){
+    StageTimer timer(STAGE_ROTATE, (uint64_t)image.width * image.height);
+    return rotate_90(image);
+}
+
+/**
+ * Rotates an image by a number of quarter turns into caller-owned storage
+ * @param image  the source image
+ * @param number the number of clockwise quarter turns; negative turns go counter-clockwise
+ * @param dst    receives the rotated image; its buffer is reused if large enough
+ * @return true if the image was rotated
+ */
+bool process_5_into(const Image& image, int number, Image& dst){
+    StageTimer timer(STAGE_PROCESS_1 + 4, (uint64_t)image.width * image.height);
+    // Normalize so negative turns rotate counter-clockwise
+    int turns = ((number % 4) + 4) % 4;
+
+    if(turns==0){
+        return copy_image_into(image, dst);
+    }
+    else if(turns==1){
+        return rotate_quarter_into(image, true, dst);
+    }
+    else if(turns==2){
+        return rotate_180_into(image, dst);
+    }
+    else{
+        return rotate_quarter_into(image, false, dst);
+    }
+}
+
+Image process_5(const Image& image, int number){
+    Image new_image;
+    process_5_into(image, number, new_image);
+    return new_image;
+}
+
+/**
+ * Enlarges an image into caller-owned storage
+ * @param image   the source image
+ * @param x_scale the horizontal scaling factor, which need not be a whole number
+ * @param y_scale the vertical scaling factor, which need not be a whole number
+ * @param dst     receives the enlarged image; its buffer is reused if large enough
+ * @return true if the image was enlarged
+ */
+bool process_6_into(const Image& image, double x_scale, double y_scale, Image& dst){
+    StageTimer timer(STAGE_PROCESS_1 + 5, (uint64_t)image.width * image.height);
+    vector<int> x_map = scale_map(image.width, x_scale);
+    vector<int> y_map = scale_map(image.height, y_scale);
+    int channels = image.channels;
+    if (image.empty() || x_map.empty() || y_map.empty() || &dst == &image
+        || !reshape_image(dst, x_map.size(), y_map.size(), channels)){
+        return false;
+    }
+    vector<uint32_t> offsets = pixel_offsets(x_map, channels);
+    size_t row_bytes = (size_t)image.width * channels;
+
+    parallel_rows(dst.height, [&](int begin, int end) {
+        for(int row=begin; row<end; row++){
+            uint8_t* out = dst.row(row);
+            // Repeated source rows are copied from the row above rather than expanded again
+            if(row > begin && y_map[row] == y_map[row-1]){
+                memcpy(out, dst.row(row-1), (size_t)dst.width * channels);
+            }
+            else{
+                replicate_row(image.row(y_map[row]), row_bytes, offsets.data(), dst.width, channels, out);
+            }
+        }
+    });
+
+    return true;
+}
+
+Image process_6(const Image& image, double x_scale, double y_scale){
+    Image new_image;
+    process_6_into(image, x_scale, y_scale, new_image);
+    return new_image;
+}
+
+Image process_7(const Image& image){
+    StageTimer timer(STAGE_PROCESS_1 + 6, (uint64_t)image.width * image.height);
+    Image new_image = clone_image(image);
+    apply_point_op({7, 0}, new_image);
+    return new_image;
+}
+
+Image process_8(const Image& image, double scaling_factor){
+    StageTimer timer(STAGE_PROCESS_1 + 7, (uint64_t)image.width * image.height);
+    Image new_image = clone_image(image);
+    apply_point_op({8, scaling_factor}, new_image);
+    return new_image;
+}
+
+Image process_9(const Image& image, double scaling_factor){
+    StageTimer timer(STAGE_PROCESS_1 + 8, (uint64_t)image.width * image.height);
+    Image new_image = clone_image(image);
+    apply_point_op({9, scaling_factor}, new_image);
+    return new_image;
+}
+
+Image process_10(const Image& image){
+    StageTimer timer(STAGE_PROCESS_1 + 9, (uint64_t)image.width * image.height);
+    Image new_image = clone_image(image);
+    apply_point_op({10, 0}, new_image);
+    return new_image;
+}
+
+//***************************************************************************************************//
+//                                   IN-PLACE IMAGE FILTERS                                          //
+//***************************************************************************************************//
+
+// The point filters overwrite the image they are given, allocating nothing
+
+void process_1_in_place(Image& image)
+{
+    StageTimer timer(STAGE_PROCESS_1, (uint64_t)image.width * image.height);
+    apply_point_op({1, 0}, image);
+}
+
+void process_2_in_place(Image& image, double scaling_factor)
+{
+    StageTimer timer(STAGE_PROCESS_1 + 1, (uint64_t)image.width * image.height);
+    apply_point_op({2, scaling_factor}, image);
+}
+
+void process_3_in_place(Image& image)
+{
+    StageTimer timer(STAGE_PROCESS_1 + 2, (uint64_t)image.width * image.height);
+    apply_point_op({3, 0}, image);
+}
+
+void process_7_in_place(Image& image)
+{
+    StageTimer timer(STAGE_PROCESS_1 + 6, (uint64_t)image.width * image.height);
+    apply_point_op({7, 0}, image);
+}
+
+void process_8_in_place(Image& image, double scaling_factor)
+{
+    StageTimer timer(STAGE_PROCESS_1 + 7, (uint64_t)image.width * image.height);
+    apply_point_op({8, scaling_factor}, image);
+}
+
+void process_9_in_place(Image& image, double scaling_factor)
+{
+    StageTimer timer(STAGE_PROCESS_1 + 8, (uint64_t)image.width * image.height);
+    apply_point_op({9, scaling_factor}, image);
+}
+
+void process_10_in_place(Image& image)
+{
+    StageTimer timer(STAGE_PROCESS_1 + 9, (uint64_t)image.width * image.height);
+    apply_point_op({10, 0}, image);
+}
+
+//***************************************************************************************************//
+//                                        PREVIEW PYRAMID                                            //
+//***************************************************************************************************//
+
+// Levels of a preview pyramid, each half the size of the one before
+const int PYRAMID_LEVELS = 3;
+
+// Reduced copies of an image at 1/2, 1/4 and 1/8 of its size, built once so
+// that trying out a filter setting does not touch every full-size pixel
+struct ImagePyramid
+{
+    Image levels[PYRAMID_LEVELS];
+};
+
+/**
+ * Builds the preview pyramid of an image, each level from the one before
+ * @param image   the full-size image
+ * @param pyramid receives the levels; their buffers are reused if large enough
+ * @return true if every level was made
+ */
+bool build_pyramid(const Image& image, ImagePyramid& pyramid)
+{
+    StageTimer timer(STAGE_PYRAMID, (uint64_t)image.width * image.height);
+    const Image* source = &image;
+    for (int i = 0; i < PYRAMID_LEVELS; i++)
+    {
+        if (!halve_image_into(*source, pyramid.levels[i]))
+        {
+            return false;
+        }
+        source = &pyramid.levels[i];
+    }
+    return true;
+}
+
+/**
+ * Picks the smallest image at least as large as a requested preview size
+ * @param image   the full-size image, used when no level is large enough
+ * @param pyramid the levels of the image
+ * @param width   the requested width in pixels
+ * @param height  the requested height in pixels
+ * @return the level to preview on
+ */
+const Image& preview_level(const Image& image, const ImagePyramid& pyramid, int width, int height)
+{
+    for (int i = PYRAMID_LEVELS - 1; i >= 0; i--)
+    {
+        const Image& level = pyramid.levels[i];
+        if (level.width >= width && level.height >= height)
+        {
+            return level;
+        }
+    }
+    return image;
+}
+
+/**
+ * Renders a point filter on a pyramid level for previewing
+ * @param level   the level to render from, which is left unchanged
+ * @param op      the filter and its scaling factor
+ * @param preview receives the filtered level; its buffer is reused between previews
+ * @return true if the preview was rendered
+ */
+bool render_preview(const Image& level, const PointOp& op, Image& preview)
+{
+    StageTimer timer(STAGE_PREVIEW, (uint64_t)level.width * level.height);
+    if (!copy_image_into(level, preview))
+    {
+        return false;
+    }
+    apply_point_op(op, preview);
+    return true;
+}
+
+//***************************************************************************************************//
+//                                      MAPPED FILE OUTPUT                                           //
+//***************************************************************************************************//
+
+// Every BMP scanline has a fixed size and offset once the width is known, so
+// an output file can be created at its final size, mapped, and filled in any
+// order by any number of threads.
+
+// A BMP file being written through a shared mapping of its pages
+struct MappedOutput
+{
+    int fd = -1;
+    string filename;           // The output the file replaces
+    string temporary;          // The name it is written under, from create_output()
+    uint8_t* base = nullptr;   // Start of the file, or null if it is not mapped
+    size_t size = 0;           // Size of the whole file in bytes
+    size_t row_bytes = 0;      // Bytes per scanline, including padding
+    int height = 0;            // Height of the image in pixels
+
+    /**
+     * Finds where an image row is stored in the file
+     * @param y the image row
+     * @return the first byte of its scanline
+     */
+    uint8_t* scanline(int y) const
+    {
+        return base + BMP_HEADER_SIZE + DIB_HEADER_SIZE + (size_t)(height - 1 - y) * row_bytes;
+    }
+};
+
+/**
+ * Creates a BMP file at its final size, maps it and stores its headers
+ * The blocks are reserved with fallocate() rather than just sized with
+ * ftruncate(), so a full disk is reported here instead of as a SIGBUS on a
+ * later store. Files that cannot reserve blocks or be mapped leave
+ * output.base null, and the caller writes the file normally instead.
+ * @param filename       the BMP file to create
+ * @param width          width of the image in pixels
+ * @param height         height of the image in pixels
+ * @param bits_per_pixel depth of the file, 24 or 32
+ * @param output         receives the mapping
+ * @return false, with errno set, if the file cannot be created or has no room
+ */
+bool map_bmp_output(const string& filename, int width, int height, int bits_per_pixel, MappedOutput& output)
+{
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+    uint64_t array_bytes;
+    output = MappedOutput();
+    if (!make_bmp_header(header, width, height, bits_per_pixel, array_bytes))
+    {
+        return false;
+    }
+    output.size = sizeof(header) + array_bytes;
+    output.row_bytes = array_bytes / height;
+    output.height = height;
+
+    output.filename = filename;
+    output.fd = create_output(filename, output.temporary, O_RDWR);
+    if (output.fd < 0)
+    {
+        return false;
+    }
+    if (fallocate(output.fd, 0, 0, output.size) != 0)
+    {
+        // Only a lack of space is final; pipes and other files that cannot
+        // reserve blocks are written normally. Either way the file just made
+        // is removed.
+        int reason = errno;
+        replace_output(output.fd, output.temporary, filename, false);
+        output.fd = -1;
+        errno = reason;
+        return reason != ENOSPC && reason != EDQUOT && reason != EFBIG;
+    }
+
+    // Populating takes the page faults in one pass instead of one per page stored
+    void* mapping = mmap(nullptr, output.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, output.fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        replace_output(output.fd, output.temporary, filename, false);
+        output.fd = -1;
+        return true;
+    }
+    output.base = (uint8_t*)mapping;
+    memcpy(output.base, header, sizeof(header));
+    return true;
+}
+
+/**
+ * Unmaps and closes a mapped BMP file and puts it in place of its output
+ * The stores are already in the page cache, so nothing is copied here.
+ * @param output the mapping to finish
+ * @return true if the file was closed cleanly and replaced the output
+ */
+bool finish_mapped_output(MappedOutput& output)
+{
+    bool success = true;
+    if (output.base != nullptr)
+    {
+        success = munmap(output.base, output.size) == 0;
+        output.base = nullptr;
+    }
+    if (output.fd >= 0)
+    {
+        success = replace_output(output.fd, output.temporary, output.filename, success);
+        output.fd = -1;
+    }
+    return success;
+}
+
+/**
+ * Writes an image, after a chain of point filters, straight into a mapped BMP file
+ * Threads convert disjoint ranges of rows into the file's pages and filter
+ * them there, so neither a filtered copy of the image nor an output buffer
+ * exists, and the image is left unchanged. If the file cannot be mapped, the
+ * image is filtered in place and written with write_bmp() instead.
+ * @param filename       the BMP file name to save the image to
+ * @param image          the image to save
+ * @param chain          the point filters to apply first, in order; may be empty
+ * @param stats          if not null, receives the bytes written and elapsed time
+ * @param bits_per_pixel depth of the file: 24, 32, or 0 to match the image
+ * @return true if successful and false otherwise
+ */
+bool write_mapped_bmp(const string& filename, Image& image, const vector<PointOp>& chain,
+                      IoStats* stats = nullptr, int bits_per_pixel = 24)
+{
+    if (bits_per_pixel == 0)
+    {
+        bits_per_pixel = image.channels * 8;
+    }
+    if (image.empty() || (bits_per_pixel != 24 && bits_per_pixel != 32))
+    {
+        return false;
+    }
+
+    MappedOutput output;
+    if (!map_bmp_output(filename, image.width, image.height, bits_per_pixel, output))
+    {
+        return false;
+    }
+    if (output.base == nullptr)
+    {
+        if (!chain.empty())
+        {
+            apply_point_chain(chain, image);
+        }
+        return write_bmp(filename, image, stats, bits_per_pixel);
+    }
+
+    StageTimer timer(STAGE_WRITE, (uint64_t)image.width * image.height);
+    auto start_time = chrono::steady_clock::now();
+    vector<PreparedOp> prepared = prepare_point_chain(chain);
+    RowSpan span;
+    span.count = image.width;
+    span.channels = bits_per_pixel / 8;
+    span.num_columns = image.width;
+    span.num_rows = image.height;
+
+    parallel_rows(image.height, [&](int begin, int end) {
+        RowSpan row_span = span;
+        for (int y = begin; y < end; y++)
+        {
+            row_span.pixels = output.scanline(y);
+            row_span.y = y;
+            encode_scanline(image, y, row_span.pixels, bits_per_pixel);
+            if (!prepared.empty())
+            {
+                apply_point_chain(prepared, row_span);
+            }
+        }
+    });
+
+    uint64_t bytes = output.size;
+    bool success = finish_mapped_output(output);
+    if (success)
+    {
+        timer.add_bytes_written(bytes);
+    }
+    if (stats != nullptr)
+    {
+        stats->bytes = success ? bytes : 0;
+        stats->seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    }
+    return success;
+}
+
+//***************************************************************************************************//
+//                                     STREAMING POINT FILTERS                                       //
+//***************************************************************************************************//
+
+// Rows are streamed through a band of roughly this many bytes
+const size_t STREAM_BAND_SIZE = 1 << 20;
+
+/**
+ * Opens a BMP file for streaming and validates its header
+ * @param input   the BMP file to read
+ * @param info    receives the layout of the pixel array
+ * @param message receives a description of any failure
+ * @return the open file, or -1 if message was set; a file is returned even on
+ *         failure when it was opened, so the caller always closes what it gets
+ */
+int open_bmp_stream(const string& input, BmpInfo& info, string& message)
+{
+    int in_fd = open(input.c_str(), O_RDONLY);
+    struct stat file_stat;
+    uint8_t header[MAX_HEADER_SIZE];
+
+    if (in_fd < 0 || fstat(in_fd, &file_stat) != 0)
+    {
+        message = string("cannot open input: ") + strerror(errno);
+    }
+    else if (!read_fully(in_fd, header, min<uint64_t>(sizeof(header), file_stat.st_size), 0)
+             || !parse_bmp_header(header, min<uint64_t>(sizeof(header), file_stat.st_size), file_stat.st_size, info, message))
+    {
+        if (message.empty())
+        {
+            message = "cannot read header";
+        }
+    }
+    else
+    {
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return in_fd;
+}
+
+/**
+ * Applies a chain of point filters to a BMP file without loading the whole image
+ * Bands of scanlines are read, filtered in place and written to the output in
+ * file order, so peak memory is one band no matter how large the image is.
+ * The output is always stored bottom to top, so the bands of a top-down file
+ * are written from the end of the output backwards.
+ * @param input          the BMP file to read
+ * @param output         the BMP file to create
+ * @param chain          the point filters to apply, in order
+ * @param error          if not null, receives a description of any failure
+ * @param bits_per_pixel depth of the output: 24, 32, or 0 to match the input
+ * @return true if the output was written
+ */
+bool stream_point_chain(const string& input, const string& output, const vector<PointOp>& chain,
+                        string* error = nullptr, int bits_per_pixel = 24)
+{
+    StageTimer timer(STAGE_STREAM_POINT);
+    string message;
+    BmpInfo info;
+    int in_fd = open_bmp_stream(input, info, message);
+
+    int out_fd = -1;
+    string temporary;
+    if (message.empty())
+    {
+        // Written beside the output and renamed over it, so an output that is the input survives the read
+        out_fd = create_output(output, temporary);
+        if (out_fd < 0)
+        {
+            message = string("cannot create output: ") + strerror(errno);
+        }
+    }
+
+    if (message.empty())
+    {
+        int in_channels = info.bits_per_pixel / 8;
+        int out_channels = bits_per_pixel == 0 ? in_channels : bits_per_pixel / 8;
+        size_t pixel_bytes = (size_t)info.width * out_channels;
+        size_t out_row_bytes = (pixel_bytes + 3) / 4 * 4;
+        int band_rows = max<size_t>(1, STREAM_BAND_SIZE / info.row_bytes);
+        vector<uint8_t> band(band_rows * info.row_bytes);
+
+        // Scanlines that grow cannot be repacked in place
+        vector<uint8_t> wide(out_row_bytes > info.row_bytes ? band_rows * out_row_bytes : 0);
+        uint8_t* out_band = wide.empty() ? band.data() : wide.data();
+
+        unsigned char out_header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+        uint64_t array_bytes;
+        vector<struct iovec> iov = {{out_header, sizeof(out_header)}};
+        bool success = make_bmp_header(out_header, info.width, info.height, out_channels * 8, array_bytes)
+                       && write_all(out_fd, iov.data(), 1);
+        timer.add_pixels((uint64_t)info.width * info.height);
+
+        RowSpan span;
+        vector<PreparedOp> prepared = prepare_point_chain(chain);
+        span.count = info.width;
+        span.channels = in_channels;
+        span.num_columns = info.width;
+        span.num_rows = info.height;
+
+        for (int k = 0; k < info.height && success; k += band_rows)
+        {
+            int count = min(band_rows, info.height - k);
+            if (!read_fully(in_fd, band.data(), count * info.row_bytes, info.pixel_offset + k * info.row_bytes))
+            {
+                message = "unexpected end of file";
+                break;
+            }
+
+            parallel_rows(count, [&](int begin, int end) {
+                RowSpan row_span = span;
+                for (int r = begin; r < end; r++)
+                {
+                    row_span.pixels = band.data() + r * info.row_bytes;
+                    row_span.y = info.image_row(k + r);
+                    apply_point_chain(prepared, row_span);
+                }
+            });
+
+            // Repack into output scanlines; in place, the output rows never overtake the input rows
+            for (int r = 0; r < count; r++)
+            {
+                uint8_t* dst = out_band + r * out_row_bytes;
+                if (out_channels != in_channels)
+                {
+                    repack_pixels(band.data() + r * info.row_bytes, in_channels, dst, out_channels, info.width);
+                }
+                memset(dst + pixel_bytes, 0, out_row_bytes - pixel_bytes);
+            }
+
+            // Bottom-up files are written straight through; top-down bands are
+            // placed at the mirrored position with their rows reversed
+            if (!info.top_down)
+            {
+                iov.assign(1, {out_band, count * out_row_bytes});
+            }
+            else
+            {
+                uint64_t offset = sizeof(out_header) + (uint64_t)(info.height - k - count) * out_row_bytes;
+                success = lseek(out_fd, offset, SEEK_SET) == (off_t)offset;
+                iov.clear();
+                for (int r = count - 1; r >= 0; r--)
+                {
+                    iov.push_back({out_band + r * out_row_bytes, out_row_bytes});
+                }
+            }
+            success = success && write_all(out_fd, iov.data(), iov.size());
+        }
+        if (!success && message.empty())
+        {
+            message = string("cannot write output: ") + strerror(errno);
+        }
+        if (message.empty())
+        {
+            timer.add_bytes_read(info.pixel_offset + (uint64_t)info.row_bytes * info.height);
+            timer.add_bytes_written(sizeof(out_header) + array_bytes);
+        }
+    }
+
+    if (in_fd >= 0)
+    {
+        close(in_fd);
+    }
+    if (out_fd >= 0 && !replace_output(out_fd, temporary, output, message.empty()) && message.empty())
+    {
+        message = string("cannot write output: ") + strerror(errno);
+    }
+    if (!message.empty() && error != nullptr)
+    {
+        *error = message;
+    }
+    return message.empty();
+}
+
+/**
+ * Applies a point filter to a BMP file without loading the whole image
+ * @param input          the BMP file to read
+ * @param output         the BMP file to create
+ * @param op             the point filter to apply
+ * @param error          if not null, receives a description of any failure
+ * @param bits_per_pixel depth of the output: 24, 32, or 0 to match the input
+ * @return true if the output was written
+ */
+bool stream_point_op(const string& input, const string& output, const PointOp& op,
+                     string* error = nullptr, int bits_per_pixel = 24)
+{
+    return stream_point_chain(input, output, {op}, error, bits_per_pixel);
+}
+
+/**
+ * Enlarges a BMP file without loading the input or building the output image
+ * Source scanlines are read in bands in file order; every one that is needed
+ * is expanded once and written as many times as it repeats.
+ * @param input          the BMP file to read
+ * @param output         the BMP file to create
+ * @param x_scale        the horizontal scaling factor, which need not be a whole number
+ * @param y_scale        the vertical scaling factor, which need not be a whole number
+ * @param error          if not null, receives a description of any failure
+ * @param bits_per_pixel depth of the output: 24, 32, or 0 to match the input
+ * @return true if the output was written
+ */
+bool stream_enlarge(const string& input, const string& output, double x_scale, double y_scale,
+                    string* error = nullptr, int bits_per_pixel = 24)
+{
+    StageTimer timer(STAGE_STREAM_ENLARGE);
+    string message;
+    BmpInfo info;
+    int in_fd = open_bmp_stream(input, info, message);
+
+    vector<int> x_map, y_map;
+    if (message.empty())
+    {
+        x_map = scale_map(info.width, x_scale);
+        y_map = scale_map(info.height, y_scale);
+        if (x_map.empty() || y_map.empty())
+        {
+            message = "invalid scale";
+        }
+    }
+
+    int out_fd = -1;
+    string temporary;
+    if (message.empty())
+    {
+        // Written beside the output and renamed over it, so an output that is the input survives the read
+        out_fd = create_output(output, temporary);
+        if (out_fd < 0)
+        {
+            message = string("cannot create output: ") + strerror(errno);
+        }
+    }
+
+    if (message.empty())
+    {
+        int band_rows = max<size_t>(1, STREAM_BAND_SIZE / info.row_bytes);
+        vector<uint8_t> band(band_rows * info.row_bytes);
+        int band_first = 0;
+        int band_count = 0;
+        bool read_failed = false;
+        uint64_t bytes_read = info.pixel_offset;
+        uint64_t bytes_written = 0;
+        timer.add_pixels((uint64_t)x_map.size() * y_map.size());
+
+        // Rows are requested bottom to top, which is file order unless the file
+        // is top-down; either way a band is only reloaded when a row past it is needed
+        auto source_row = [&](int y) -> const uint8_t* {
+            int k = info.image_row(y);
+            if (k < band_first || k >= band_first + band_count)
+            {
+                band_first = info.top_down ? max(0, k - band_rows + 1) : k;
+                band_count = min(band_rows, info.height - band_first);
+                bytes_read += (uint64_t)band_count * info.row_bytes;
+                if (!read_fully(in_fd, band.data(), band_count * info.row_bytes,
+                                info.pixel_offset + (uint64_t)band_first * info.row_bytes))
+                {
+                    // Keep going on zeroed pixels; the failure is reported below
+                    memset(band.data(), 0, band.size());
+                    read_failed = true;
+                }
+            }
+            return band.data() + (k - band_first) * info.row_bytes;
+        };
+
+        int out_bits = bits_per_pixel == 0 ? info.bits_per_pixel : bits_per_pixel;
+        bool written = write_scaled(out_fd, info.bits_per_pixel / 8, out_bits, x_map, y_map, source_row, &bytes_written);
+        timer.add_bytes_read(bytes_read);
+        timer.add_bytes_written(bytes_written);
+        if (!written)
+        {
+            message = string("cannot write output: ") + strerror(errno);
+        }
+        else if (read_failed)
+        {
+            message = "unexpected end of file";
+        }
+    }
+
+    if (in_fd >= 0)
+    {
+        close(in_fd);
+    }
+    if (out_fd >= 0 && !replace_output(out_fd, temporary, output, message.empty()) && message.empty())
+    {
+        message = string("cannot write output: ") + strerror(errno);
+    }
+    if (!message.empty() && error != nullptr)
+    {
+        *error = message;
+    }
+    return message.empty();
+}
+
+//***************************************************************************************************//
+//                                     OUT-OF-CORE TRANSFORMS                                        //
+//***************************************************************************************************//
+
+// Pixel memory an out-of-core transform may use unless told otherwise
+const size_t DEFAULT_MEMORY_BUDGET = 256 << 20;
+
+// Limits on an out-of-core transform
+struct OutOfCoreOptions
+{
+    size_t memory_budget = DEFAULT_MEMORY_BUDGET;   // Bytes of pixel buffers to stay within
+    string scratch_dir;                             // Where to spill tiles; empty for the output's directory
+    bool automatic = false;                         // Use it for any image whose pixels exceed the budget
+};
+
+/**
+ * Creates an anonymous scratch file that disappears when it is closed
+ * @param directory where to create it
+ * @return the open file, or -1 with errno set
+ */
+int open_scratch_file(const string& directory)
+{
+#ifdef O_TMPFILE
+    int fd = open(directory.c_str(), O_TMPFILE | O_RDWR, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+    {
+        return fd;
+    }
+#endif
+    // Filesystems without O_TMPFILE get a named file that is unlinked at once
+    string name = directory + "/.imgproc-scratch-XXXXXX";
+    int fd_named = mkstemp(&name[0]);
+    if (fd_named >= 0)
+    {
+        unlink(name.c_str());
+    }
+    return fd_named;
+}
+
+/**
+ * Reads consecutive image rows from an open BMP file
+ * @param fd     the file
+ * @param info   the layout of its pixel array
+ * @param first  the top image row to read
+ * @param count  the number of rows
+ * @param band   receives the rows as an image of count rows
+ * @param buffer holds the raw scanlines; grown as needed and kept for reuse
+ * @return true if the rows were read
+ */
+bool read_image_rows(int fd, const BmpInfo& info, int first, int count, Image& band, vector<uint8_t>& buffer)
+{
+    // The rows form a smaller image stored the same way round as the file
+    BmpInfo band_info = info;
+    band_info.height = count;
+    int first_scanline = info.top_down ? first : info.height - first - count;
+    buffer.resize(max(buffer.size(), count * info.row_bytes));
+    if (!reshape_image(band, info.width, count, info.bits_per_pixel / 8)
+        || !read_fully(fd, buffer.data(), count * info.row_bytes, info.pixel_offset + (uint64_t)first_scanline * info.row_bytes))
+    {
+        return false;
+    }
+    parallel_rows(count, [&](int begin, int end) {
+        decode_scanlines(band_info, buffer.data() + begin * info.row_bytes, begin, end - begin, band);
+    });
+    return true;
+}
+
+/**
+ * Rotates a BMP file a quarter turn through a scratch file
+ * Bands of source rows become vertical strips of the output, so each band is
+ * rotated and spilled to the scratch file as a packed block. The output is
+ * then assembled a band of rows at a time, bottom first, by reading the
+ * matching slice of every block.
+ * @param in_fd          the source file
+ * @param info           the layout of its pixel array
+ * @param out_fd         the output file, positioned after the headers
+ * @param clockwise      the direction to turn
+ * @param options        the memory budget and scratch directory
+ * @param bits_per_pixel depth of the output scanlines
+ * @param message        receives a description of any failure
+ */
+void tiled_rotate_quarter(int in_fd, const BmpInfo& info, int out_fd, bool clockwise, const OutOfCoreOptions& options,
+                          int bits_per_pixel, string& message)
+{
+    int channels = info.bits_per_pixel / 8;
+    int out_width = info.height;
+    int out_height = info.width;
+    int scratch_fd = open_scratch_file(options.scratch_dir);
+    if (scratch_fd < 0)
+    {
+        message = string("cannot create scratch file: ") + strerror(errno);
+        return;
+    }
+
+    // A band is held three times over: as scanlines, decoded and rotated
+    size_t source_row_bytes = (size_t)info.width * channels;
+    int band_rows = min<size_t>(info.height, max<size_t>(1, options.memory_budget / (3 * source_row_bytes)));
+    size_t block_row_bytes = (size_t)band_rows * channels;
+
+    // Block k holds output columns [column, column + columns) of every output row
+    struct Block
+    {
+        uint64_t offset;
+        int column;
+        int columns;
+    };
+    vector<Block> blocks;
+    {
+        Image band, rotated;
+        vector<uint8_t> buffer;
+        vector<struct iovec> iov;
+        uint64_t offset = 0;
+        for (int r0 = 0; r0 < info.height && message.empty(); r0 += band_rows)
+        {
+            int count = min(band_rows, info.height - r0);
+            if (!read_image_rows(in_fd, info, r0, count, band, buffer))
+            {
+                message = "unexpected end of file";
+                break;
+            }
+            if (!rotate_quarter_into(band, clockwise, rotated))
+            {
+                message = "out of memory";
+                break;
+            }
+            blocks.push_back({offset, clockwise ? info.height - r0 - count : r0, count});
+
+            // Rows are written without their alignment padding
+            size_t packed = (size_t)count * channels;
+            for (int y = 0; y < out_height && message.empty(); y += MAX_WRITE_VECTORS)
+            {
+                iov.clear();
+                for (int k = y; k < min(y + MAX_WRITE_VECTORS, out_height); k++)
+                {
+                    iov.push_back({rotated.row(k), packed});
+                }
+                if (!write_all(scratch_fd, iov.data(), iov.size()))
+                {
+                    message = string("cannot write scratch file: ") + strerror(errno);
+                }
+            }
+            offset += packed * out_height;
+        }
+    }
+
+    // Output rows are assembled bottom first, so the output is written in file order
+    size_t out_row_bytes = ((size_t)out_width * (bits_per_pixel / 8) + 3) / 4 * 4;
+    size_t assembled_row_bytes = (size_t)out_width * channels + block_row_bytes + out_row_bytes;
+    int rows = min<size_t>(out_height, max<size_t>(1, options.memory_budget / assembled_row_bytes));
+    Image band;
+    vector<uint8_t> slice(rows * block_row_bytes);
+    vector<uint8_t> block;
+    for (int y1 = out_height; y1 > 0 && message.empty(); y1 -= rows)
+    {
+        int y0 = max(0, y1 - rows);
+        int count = y1 - y0;
+        if (!reshape_image(band, out_width, count, channels))
+        {
+            message = "out of memory";
+            break;
+        }
+        for (const Block& b : blocks)
+        {
+            size_t packed = (size_t)b.columns * channels;
+            if (!read_fully(scratch_fd, slice.data(), count * packed, b.offset + y0 * packed))
+            {
+                message = "cannot read scratch file";
+                break;
+            }
+            parallel_rows(count, [&](int begin, int end) {
+                for (int r = begin; r < end; r++)
+                {
+                    memcpy(band.row(r) + (size_t)b.column * channels, slice.data() + r * packed, packed);
+                }
+            });
+        }
+        if (message.empty() && !write_scanlines(out_fd, band, bits_per_pixel, block))
+        {
+            message = string("cannot write output: ") + strerror(errno);
+        }
+    }
+    close(scratch_fd);
+}
+
+/**
+ * Rotates a BMP file half a turn, or copies it, a band at a time
+ * Half a turn maps the top band of the source onto the bottom band of the
+ * output, so no scratch file is needed: source bands are taken from the top,
+ * turned in place and written in file order.
+ * @param in_fd          the source file
+ * @param info           the layout of its pixel array
+ * @param out_fd         the output file, positioned after the headers
+ * @param half_turn      false to copy the image unchanged
+ * @param options        the memory budget
+ * @param bits_per_pixel depth of the output scanlines
+ * @param message        receives a description of any failure
+ */
+void tiled_rotate_half(int in_fd, const BmpInfo& info, int out_fd, bool half_turn, const OutOfCoreOptions& options,
+                       int bits_per_pixel, string& message)
+{
+    size_t row_bytes = (size_t)info.width * (info.bits_per_pixel / 8);
+    int band_rows = min<size_t>(info.height, max<size_t>(1, options.memory_budget / (3 * row_bytes)));
+    Image band;
+    vector<uint8_t> buffer, block;
+    for (int k = 0; k < info.height && message.empty(); k += band_rows)
+    {
+        int count = min(band_rows, info.height - k);
+        int first = half_turn ? k : info.height - k - count;
+        if (!read_image_rows(in_fd, info, first, count, band, buffer))
+        {
+            message = "unexpected end of file";
+            break;
+        }
+        if (half_turn)
+        {
+            rotate_180_in_place(band);
+        }
+        if (!write_scanlines(out_fd, band, bits_per_pixel, block))
+        {
+            message = string("cannot write output: ") + strerror(errno);
+        }
+    }
+}
+
+/**
+ * Rotates or enlarges a BMP file of any size within a memory budget
+ * The source is read in bands and quarter turns spill their rotated tiles to
+ * a scratch file, so neither the source nor the output is ever held whole.
+ * An enlarge is streamed, which already needs only a band of source rows.
+ * @param input          the BMP file to read
+ * @param output         the BMP file to create
+ * @param process        5 to rotate, 6 to enlarge
+ * @param scale          the number of clockwise turns, or the horizontal scaling factor
+ * @param y_scale        the vertical scaling factor of an enlarge
+ * @param options        the memory budget and scratch directory
+ * @param error          if not null, receives a description of any failure
+ * @param bits_per_pixel depth of the output: 24, 32, or 0 to match the input
+ * @return true if the output was written
+ */
+bool transform_bmp_file(const string& input, const string& output, int process, double scale, double y_scale,
+                        const OutOfCoreOptions& options, string* error = nullptr, int bits_per_pixel = 24)
+{
+    if (process == 6)
+    {
+        return stream_enlarge(input, output, scale, y_scale, error, bits_per_pixel);
+    }
+
+    StageTimer timer(STAGE_TILED_ROTATE);
+    string message;
+    BmpInfo info;
+    int in_fd = process == 5 ? open_bmp_stream(input, info, message) : -1;
+    if (process != 5)
+    {
+        message = "operation cannot run out of core";
+    }
+    else if (message.empty())
+    {
+        // Bands may be taken against file order, where sequential read-ahead is wasted
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_NORMAL);
+    }
+
+    int out_fd = -1;
+    string temporary;
+    if (message.empty())
+    {
+        // Written beside the output and renamed over it, so an output that is the input survives the read
+        out_fd = create_output(output, temporary);
+        if (out_fd < 0)
+        {
+            message = string("cannot create output: ") + strerror(errno);
+        }
+    }
+
+    if (message.empty())
+    {
+        int turns = (((int)scale % 4) + 4) % 4;
+        bool quarter = turns % 2 == 1;
+        int out_bits = bits_per_pixel == 0 ? info.bits_per_pixel : bits_per_pixel;
+        unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE];
+        uint64_t array_bytes;
+        struct iovec chunk = {header, sizeof(header)};
+        timer.add_pixels((uint64_t)info.width * info.height);
+        if (!make_bmp_header(header, quarter ? info.height : info.width, quarter ? info.width : info.height, out_bits,
+                             array_bytes)
+            || !write_all(out_fd, &chunk, 1))
+        {
+            message = string("cannot write output: ") + strerror(errno);
+        }
+        else if (quarter)
+        {
+            OutOfCoreOptions spill = options;
+            if (spill.scratch_dir.empty())
+            {
+                size_t slash = output.find_last_of('/');
+                spill.scratch_dir = slash == string::npos ? "." : slash == 0 ? "/" : output.substr(0, slash);
+            }
+            tiled_rotate_quarter(in_fd, info, out_fd, turns == 1, spill, out_bits, message);
+        }
+        else
+        {
+            tiled_rotate_half(in_fd, info, out_fd, turns == 2, options, out_bits, message);
+        }
+        if (message.empty())
+        {
+            timer.add_bytes_read(info.pixel_offset + (uint64_t)info.row_bytes * info.height);
+            timer.add_bytes_written(sizeof(header) + array_bytes);
+        }
+    }
+
+    if (in_fd >= 0)
+    {
+        close(in_fd);
+    }
+    if (out_fd >= 0 && !replace_output(out_fd, temporary, output, message.empty()) && message.empty())
+    {
+        message = string("cannot write output: ") + strerror(errno);
+    }
+    if (!message.empty() && error != nullptr)
+    {
+        *error = message;
+    }
+    return message.empty();
+}
+
+//***************************************************************************************************//
+//                          VECTOR OF PIXELS VERSIONS OF THE IMAGE FILTERS                           //
+//***************************************************************************************************//
+
+vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_1(to_image(image)));
+}
+
+vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_2(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_3(to_image(image)));
+}
+
+vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_4(to_image(image)));
+}
+
+vector<vector<Pixel>> rotateby90(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(rotateby90(to_image(image)));
+}
+
+vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+{
+    return to_pixels(process_5(to_image(image), number));
+}
+
+vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+{
+    return to_pixels(process_6(to_image(image), x_scale, y_scale));
+}
+
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_7(to_image(image)));
+}
+
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_8(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return to_pixels(process_9(to_image(image), scaling_factor));
+}
+
+vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+{
+    return to_pixels(process_10(to_image(image)));
+}
+
+//***************************************************************************************************//
+//                                          RESULT CACHE                                             //
+//***************************************************************************************************//
+
+// Input files are hashed in chunks of this many bytes, one chunk per task
+const size_t HASH_CHUNK_SIZE = 1 << 20;
+
+// Changing how results are produced or keyed must bump this to retire old entries
+const uint64_t CACHE_FORMAT_VERSION = 2;
+
+// Decoded images kept by the interactive menu, in bytes of pixels
+const size_t DECODED_IMAGE_BUDGET = (size_t)1 << 30;
+
+const uint64_t HASH_PRIME_1 = 11400714785074694791ULL;
+const uint64_t HASH_PRIME_2 = 14029467366897019727ULL;
+const uint64_t HASH_PRIME_3 = 1609587929392839161ULL;
+const uint64_t HASH_PRIME_4 = 9650029242287828579ULL;
+const uint64_t HASH_PRIME_5 = 2870177450012600261ULL;
+
+inline uint64_t rotate_left(uint64_t value, int bits)
+{
+    return value << bits | value >> (64 - bits);
+}
+
+inline uint64_t hash_round(uint64_t accumulator, uint64_t input)
+{
+    return rotate_left(accumulator + input * HASH_PRIME_2, 31) * HASH_PRIME_1;
+}
+
+inline uint64_t read_word(const uint8_t* bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    return word;
+}
+
+/**
+ * Hashes a block of bytes with the XXH64 algorithm
+ * Four independent accumulators consume 32 bytes per step, so the hash runs
+ * at close to memory speed. It is not meant to resist deliberate collisions.
+ * @param data the bytes to hash
+ * @param size the number of bytes
+ * @param seed a value mixed into the hash
+ * @return the 64-bit hash
+ */
+uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + size;
+    uint64_t hash;
+
+    if (size >= 32)
+    {
+        uint64_t lanes[4] = {seed + HASH_PRIME_1 + HASH_PRIME_2, seed + HASH_PRIME_2, seed, seed - HASH_PRIME_1};
+        for (; p + 32 <= end; p += 32)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                lanes[i] = hash_round(lanes[i], read_word(p + 8 * i));
+            }
+        }
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            hash = (hash ^ hash_round(0, lanes[i])) * HASH_PRIME_1 + HASH_PRIME_4;
+        }
+    }
+    else
+    {
+        hash = seed + HASH_PRIME_5;
+    }
+
+    hash += size;
+    for (; p + 8 <= end; p += 8)
+    {
+        hash = rotate_left(hash ^ hash_round(0, read_word(p)), 27) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if (p + 4 <= end)
+    {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        hash = rotate_left(hash ^ (word * HASH_PRIME_1), 23) * HASH_PRIME_2 + HASH_PRIME_3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        hash = rotate_left(hash ^ (*p * HASH_PRIME_5), 11) * HASH_PRIME_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * Hashes the pixel array of a BMP file without decoding it
+ * The array is hashed in fixed chunks on the shared pool and the chunk hashes
+ * are hashed in order, so the result never depends on the thread count. The
+ * dimensions and pixel format are part of the hash.
+ * @param filename the BMP file
+ * @param hash     receives the hash
+ * @param error    receives a description of any failure
+ * @return true if the file was hashed
+ */
+bool hash_bmp_pixels(const string& filename, uint64_t& hash, string& error)
+{
+    BmpInfo info;
+    int fd = open_bmp_stream(filename, info, error);
+    if (error.empty())
+    {
+        uint64_t array_bytes = (uint64_t)info.row_bytes * info.height;
+        int chunks = (array_bytes + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+        vector<uint64_t> chunk_hashes(chunks + 1);
+        atomic<bool> failed{false};
+
+        parallel_rows(chunks, [&](int begin, int end) {
+            vector<uint8_t> buffer(HASH_CHUNK_SIZE);
+            for (int i = begin; i < end && !failed; i++)
+            {
+                uint64_t offset = (uint64_t)i * HASH_CHUNK_SIZE;
+                size_t bytes = min<uint64_t>(HASH_CHUNK_SIZE, array_bytes - offset);
+                if (!read_fully(fd, buffer.data(), bytes, info.pixel_offset + offset))
+                {
+                    failed = true;
+                }
+                chunk_hashes[i] = hash_bytes(buffer.data(), bytes, i);
+            }
+        }, 1);
+
+        uint64_t layout[4] = {(uint64_t)info.width, (uint64_t)info.height, (uint64_t)info.bits_per_pixel, info.top_down};
+        chunk_hashes[chunks] = hash_bytes(layout, sizeof(layout), 0);
+        hash = hash_bytes(chunk_hashes.data(), chunk_hashes.size() * sizeof(uint64_t), CACHE_FORMAT_VERSION);
+        if (failed)
+        {
+            error = "unexpected end of file";
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return error.empty();
+}
+
+/**
+ * Copies a file, letting the kernel share or copy the data where it can
+ * copy_file_range() reflinks on copy-on-write file systems and otherwise
+ * copies inside the kernel; plain reads and writes are the fallback.
+ * @param from the file to copy
+ * @param to   the file to create or replace; a file linked to it is left alone
+ * @return true if the whole file was copied
+ */
+bool copy_file(const string& from, const string& to)
+{
+    int in_fd = open(from.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (in_fd < 0 || fstat(in_fd, &file_stat) != 0)
+    {
+        if (in_fd >= 0)
+        {
+            close(in_fd);
+        }
+        return false;
+    }
+    string temporary;
+    int out_fd = create_output(to, temporary);
+    if (out_fd < 0)
+    {
+        close(in_fd);
+        return false;
+    }
+
+    bool success = true;
+    bool use_kernel = true;
+    vector<uint8_t> buffer;
+    for (off_t done = 0; done < file_stat.st_size && success; )
+    {
+        ssize_t n = -1;
+        if (use_kernel)
+        {
+            n = copy_file_range(in_fd, nullptr, out_fd, nullptr, file_stat.st_size - done, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                use_kernel = false;
+                buffer.resize(READ_BLOCK_SIZE);
+                continue;
+            }
+        }
+        else
+        {
+            size_t count = min<off_t>(buffer.size(), file_stat.st_size - done);
+            struct iovec iov = {buffer.data(), count};
+            n = read_fully(in_fd, buffer.data(), count, done) && write_all(out_fd, &iov, 1) ? count : -1;
+        }
+        success = n > 0;
+        done += max<ssize_t>(n, 0);
+    }
+
+    close(in_fd);
+    return replace_output(out_fd, temporary, to, success);
+}
+
+// Counts of cache activity since the cache was opened
+struct CacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t stores = 0;
+    uint64_t evictions = 0;
+    uint64_t bytes = 0;
+};
+
+// A directory of finished results named by their key. The least recently
+// used entries are deleted once the directory grows past its size limit;
+// use is recorded in each entry's modification time so it survives restarts.
+// Entries are written under a temporary name and renamed into place, so a
+// reader never sees a partial file. Safe to use from several threads.
+class ResultCache
+{
+public:
+    /**
+     * Opens a cache directory, creating it if needed, and indexes its entries
+     * @param directory the cache directory
+     * @param max_bytes the size the entries are kept under
+     * @param link      whether hits are hard-linked rather than copied
+     */
+    ResultCache(const string& directory, uint64_t max_bytes, bool link)
+        : directory(directory), max_bytes(max_bytes), link_hits(link)
+    {
+        mkdir(directory.c_str(), 0755);
+        DIR* dir = opendir(directory.c_str());
+        usable = dir != nullptr;
+        for (struct dirent* item; dir != nullptr && (item = readdir(dir)) != nullptr; )
+        {
+            uint64_t key;
+            struct stat file_stat;
+            string name = item->d_name;
+            if (name.size() == 20 && name.compare(16, 4, ".bmp") == 0
+                && sscanf(name.c_str(), "%16" SCNx64, &key) == 1
+                && stat(path(key).c_str(), &file_stat) == 0)
+            {
+                entries[key] = {(uint64_t)file_stat.st_size, file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec};
+                total_bytes += file_stat.st_size;
+            }
+        }
+        if (dir != nullptr)
+        {
+            closedir(dir);
+        }
+    }
+
+    bool is_usable() const
+    {
+        return usable;
+    }
+
+    /**
+     * Serves a cached result
+     * @param key    the key of the result
+     * @param output the file to place the result in
+     * @return true on a hit
+     */
+    bool fetch(uint64_t key, const string& output)
+    {
+        unique_lock<mutex> lock(index_mutex);
+        bool known = entries.count(key) != 0;
+        lock.unlock();
+
+        string entry = path(key);
+        bool served = false;
+        if (known)
+        {
+            if (link_hits)
+            {
+                // Link under a temporary name so the output stays as it was until the link exists
+                string temporary = output_temporary_name(output);
+                if (!temporary.empty() && link(entry.c_str(), temporary.c_str()) == 0)
+                {
+                    served = rename(temporary.c_str(), output.c_str()) == 0;
+
+                    // If the output already was a link to the entry the rename does nothing
+                    unlink(temporary.c_str());
+                }
+            }
+            served = served || copy_file(entry, output);
+        }
+
+        lock.lock();
+        if (served)
+        {
+            // Mark as recently used, here and on disk for later runs, unless it was evicted while unlocked
+            auto found = entries.find(key);
+            if (found != entries.end())
+            {
+                utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+                found->second.last_used = now();
+            }
+            stats.hits++;
+        }
+        else
+        {
+            stats.misses++;
+        }
+        return served;
+    }
+
+    /**
+     * Adds a finished result to the cache and evicts old entries to make room
+     * @param key    the key of the result
+     * @param result the file holding the result
+     */
+    void store(uint64_t key, const string& result)
+    {
+        struct stat file_stat;
+        if (stat(result.c_str(), &file_stat) != 0 || (uint64_t)file_stat.st_size > max_bytes)
+        {
+            return;
+        }
+        string temporary = directory + "/.partial-" + to_string(getpid()) + "-" + to_string(next_temporary++);
+        if (!copy_file(result, temporary) || rename(temporary.c_str(), path(key).c_str()) != 0)
+        {
+            unlink(temporary.c_str());
+            return;
+        }
+
+        lock_guard<mutex> lock(index_mutex);
+        auto found = entries.find(key);
+        if (found != entries.end())
+        {
+            total_bytes -= found->second.bytes;
+        }
+        entries[key] = {(uint64_t)file_stat.st_size, now()};
+        total_bytes += file_stat.st_size;
+        stats.stores++;
+
+        while (total_bytes > max_bytes)
+        {
+            auto oldest = entries.begin();
+            for (auto it = entries.begin(); it != entries.end(); ++it)
+            {
+                if (it->second.last_used < oldest->second.last_used)
+                {
+                    oldest = it;
+                }
+            }
+            unlink(path(oldest->first).c_str());
+            total_bytes -= oldest->second.bytes;
+            entries.erase(oldest);
+            stats.evictions++;
+        }
+    }
+
+    CacheStats statistics()
+    {
+        lock_guard<mutex> lock(index_mutex);
+        CacheStats result = stats;
+        result.bytes = total_bytes;
+        return result;
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t bytes;
+        long long last_used;   // Nanoseconds since the epoch
+    };
+
+    string path(uint64_t key) const
+    {
+        char name[24];
+        snprintf(name, sizeof(name), "/%016" PRIx64 ".bmp", key);
+        return directory + name;
+    }
+
+    static long long now()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    string directory;
+    uint64_t max_bytes;
+    bool link_hits;
+    bool usable = false;
+    mutex index_mutex;
+    unordered_map<uint64_t, Entry> entries;
+    uint64_t total_bytes = 0;
+    CacheStats stats;
+    atomic<uint64_t> next_temporary{0};
+};
+
+// Decoded images the interactive menu has opened, so switching back to one
+// skips reading it again. A file that changed on disk since it was decoded
+// is read again. The least recently used images go once the budget is spent.
+class DecodedImageCache
+{
+public:
+    /**
+     * Gets the decoded pixels of a BMP file
+     * @param filename the BMP file
+     * @param error    if not null, receives a description of any failure
+     * @return the image, which is empty if the file could not be read
+     */
+    shared_ptr<const Image> load(const string& filename, string* error = nullptr)
+    {
+        struct stat file_stat;
+        bool exists = stat(filename.c_str(), &file_stat) == 0;
+        tick++;
+        for (Slot& slot : slots)
+        {
+            if (exists && slot.filename == filename && slot.device == file_stat.st_dev && slot.inode == file_stat.st_ino
+                && slot.size == file_stat.st_size && slot.modified == file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec)
+            {
+                slot.last_used = tick;
+                return slot.image;
+            }
+        }
+
+        shared_ptr<const Image> image = make_shared<const Image>(read_bmp(filename, error));
+        size_t bytes = image->stride * image->height;
+        if (!exists || image->empty() || bytes > DECODED_IMAGE_BUDGET)
+        {
+            return image;
+        }
+
+        // Drop images for the same path and the least recently used ones
+        slots.erase(remove_if(slots.begin(), slots.end(), [&](const Slot& slot) { return slot.filename == filename; }), slots.end());
+        while (!slots.empty() && used_bytes() + bytes > DECODED_IMAGE_BUDGET)
+        {
+            slots.erase(min_element(slots.begin(), slots.end(), [](const Slot& a, const Slot& b) { return a.last_used < b.last_used; }));
+        }
+        slots.push_back({filename, file_stat.st_dev, file_stat.st_ino, file_stat.st_size,
+                         file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec, tick, image});
+        return image;
+    }
+
+private:
+    struct Slot
+    {
+        string filename;
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        long long modified;
+        uint64_t last_used;
+        shared_ptr<const Image> image;
+    };
+
+    size_t used_bytes() const
+    {
+        size_t total = 0;
+        for (const Slot& slot : slots)
+        {
+            total += slot.image->stride * slot.image->height;
+        }
+        return total;
+    }
+
+    vector<Slot> slots;
+    uint64_t tick = 0;
+};
+
+//***************************************************************************************************//
+//                                            BENCHMARK                                              //
+//***************************************************************************************************//
+
+// Most runs per measurement --repeat may ask for
+const int MAX_BENCH_REPEAT = 1000;
+
+// What a benchmark run measures
+struct BenchOptions
+{
+    vector<double> megapixels = {1, 12, 50, 200};
+    int repeat = 3;
+    string directory;          // Where the synthetic files go; empty for TMPDIR or /tmp
+    string output;             // The JSON report; empty for standard output
+};
+
+// One timed operation on one image size
+struct BenchResult
+{
+    string operation;
+    int width;
+    int height;
+    double seconds;            // Fastest of the repetitions
+    double median_seconds;
+    uint64_t bytes;            // Bytes read or written, or pixel bytes for filters
+    uint64_t peak_rss;         // Peak resident set size while running, in bytes
+};
+
+/**
+ * Fills an image with a repeatable mix of gradients and noise
+ * The mix reaches every filter branch: dark, mid and light pixels, grays and
+ * each dominant channel.
+ * @param image the image to fill
+ */
+void fill_synthetic(Image& image)
+{
+    parallel_rows(image.height, [&](int begin, int end) {
+        for (int y = begin; y < end; y++)
+        {
+            uint32_t state = 2654435761u * (y + 1);
+            uint8_t* px = image.row(y);
+            for (int x = 0; x < image.width; x++, px += image.channels)
+            {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                px[BLUE] = (x * 255 / image.width + (state & 31)) & 255;
+                px[GREEN] = (y * 255 / image.height + (state >> 8 & 31)) & 255;
+                px[RED] = state >> 16;
+            }
+        }
+    });
+}
+
+/**
+ * Picks image dimensions close to a pixel count with a 4:3 shape
+ * The width is odd so every scanline needs padding.
+ * @param megapixels the pixel count in millions
+ * @param width      receives the width
+ * @param height     receives the height
+ */
+void bench_dimensions(double megapixels, int& width, int& height)
+{
+    height = max(1.0, round(sqrt(megapixels * 1e6 * 3 / 4)));
+    width = max(1.0, round(megapixels * 1e6 / height));
+    width |= 1;
+}
+
+/**
+ * Starts a fresh peak resident set size measurement
+ * Linux resets the peak when 5 is written to /proc/self/clear_refs; where
+ * that is not possible the peak covers the whole process.
+ */
+void reset_peak_rss()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd >= 0)
+    {
+        ssize_t ignored = write(fd, "5", 1);
+        (void)ignored;
+        close(fd);
+    }
+}
+
+/**
+ * Gets the peak resident set size since the last reset_peak_rss()
+ * @return the peak in bytes
+ */
+uint64_t peak_rss()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+        {
+            return strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)usage.ru_maxrss * 1024;
+}
+
+/**
+ * Times an operation several times
+ * @param name   the name to report
+ * @param image  the image the operation works on, for its dimensions
+ * @param bytes  the bytes the operation moves
+ * @param repeat how many times to run it
+ * @param body   the operation
+ * @return the measurement
+ */
+BenchResult time_operation(const string& name, const Image& image, uint64_t bytes, int repeat, const function<void()>& body)
+{
+    vector<double> times;
+    reset_peak_rss();
+    for (int i = 0; i < repeat; i++)
+    {
+        auto start_time = chrono::steady_clock::now();
+        body();
+        times.push_back(chrono::duration<double>(chrono::steady_clock::now() - start_time).count());
+    }
+    sort(times.begin(), times.end());
+    return {name, image.width, image.height, times.front(), times[times.size() / 2], bytes, peak_rss()};
+}
+
+/**
+ * Writes benchmark results as JSON
+ * @param out     where to write
+ * @param results the measurements
+ * @param repeat  the repetitions behind each measurement
+ */
+void write_bench_json(ostream& out, const vector<BenchResult>& results, int repeat)
+{
+    char line[512];
+    out << "{\n"
+        << "  \"simd\": \"" << active_kernels().name << "\",\n"
+        << "  \"threads\": " << default_pool().size() << ",\n"
+        << "  \"repeat\": " << repeat << ",\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult& r = results[i];
+        double megapixels = (double)r.width * r.height / 1e6;
+        snprintf(line, sizeof(line),
+                 "%s\n    {\"operation\": \"%s\", \"width\": %d, \"height\": %d, \"megapixels\": %.3f, "
+                 "\"seconds\": %.6f, \"median_seconds\": %.6f, \"megapixels_per_second\": %.2f, "
+                 "\"bytes_per_second\": %.0f, \"peak_rss_bytes\": %" PRIu64 "}",
+                 i == 0 ? "" : ",", r.operation.c_str(), r.width, r.height, megapixels, r.seconds, r.median_seconds,
+                 megapixels / r.seconds, r.bytes / r.seconds, r.peak_rss);
+        out << line;
+    }
+    out << "\n  ]\n}\n";
+}
+
+/**
+ * Runs the benchmark: decode, every filter, rotateby90 and both encoders at each size
+ * Synthetic 24-bit files are written to a scratch directory and removed
+ * afterwards. A summary goes to standard error and JSON to the report.
+ * @param options what to measure
+ * @return 0 on success, 1 if a file could not be written or read
+ */
+int run_benchmark(const BenchOptions& options)
+{
+    string directory = options.directory;
+    if (directory.empty())
+    {
+        const char* tmpdir = getenv("TMPDIR");
+        directory = tmpdir != nullptr && *tmpdir != '\0' ? tmpdir : "/tmp";
+    }
+    string input = directory + "/imgproc-bench-" + to_string(getpid()) + "-in.bmp";
+    string output = directory + "/imgproc-bench-" + to_string(getpid()) + "-out.bmp";
+
+    vector<BenchResult> results;
+    bool success = true;
+    for (double megapixels : options.megapixels)
+    {
+        int width, height;
+        bench_dimensions(megapixels, width, height);
+        Image source = allocate_image(width, height, 3);
+        if (source.empty())
+        {
+            cerr << "bench: cannot allocate " << width << "x" << height << endl;
+            success = false;
+            break;
+        }
+        fill_synthetic(source);
+        IoStats stats;
+        if (!write_bmp(input, source, &stats))
+        {
+            cerr << "bench: cannot write " << input << ": " << strerror(errno) << endl;
+            success = false;
+            break;
+        }
+        uint64_t file_bytes = stats.bytes;
+        uint64_t pixel_bytes = (uint64_t)width * height * 3;
+        int repeat = options.repeat;
+        size_t first_result = results.size();
+
+        results.push_back(time_operation("read_bmp", source, file_bytes, repeat, [&] {
+            success = !read_bmp(input).empty() && success;
+        }));
+        results.push_back(time_operation("write_bmp", source, file_bytes, repeat, [&] {
+            success = write_bmp(output, source) && success;
+        }));
+        results.push_back(time_operation("write_mapped", source, file_bytes, repeat, [&] {
+            success = write_mapped_bmp(output, source, {}) && success;
+        }));
+
+        // Each filter builds its own output image, as the menu does
+        const struct { const char* name; function<Image()> run; } filters[] = {
+            {"process_1", [&] { return process_1(source); }},
+            {"process_2", [&] { return process_2(source, 0.5); }},
+            {"process_3", [&] { return process_3(source); }},
+            {"process_4", [&] { return process_4(source); }},
+            {"process_5", [&] { return process_5(source, 2); }},
+            {"process_6", [&] { return process_6(source, 2, 2); }},
+            {"process_7", [&] { return process_7(source); }},
+            {"process_8", [&] { return process_8(source, 0.5); }},
+            {"process_9", [&] { return process_9(source, 0.5); }},
+            {"process_10", [&] { return process_10(source); }},
+            {"rotateby90", [&] { return rotateby90(source); }},
+        };
+        for (const auto& filter : filters)
+        {
+            results.push_back(time_operation(filter.name, source, pixel_bytes, repeat, [&] {
+                Image result = filter.run();
+            }));
+        }
+
+        for (size_t i = first_result; i < results.size(); i++)
+        {
+            const BenchResult& r = results[i];
+            fprintf(stderr, "%8.1f MP  %-11s %9.2f ms %9.1f MP/s %9.1f MB/s %8.1f MB peak\n",
+                    width * (double)height / 1e6, r.operation.c_str(), r.seconds * 1000,
+                    width * (double)height / 1e6 / r.seconds, r.bytes / r.seconds / 1e6, r.peak_rss / 1e6);
+        }
+    }
+    unlink(input.c_str());
+    unlink(output.c_str());
+
+    if (options.output.empty())
+    {
+        write_bench_json(cout, results, options.repeat);
+    }
+    else
+    {
+        ofstream report(options.output);
+        write_bench_json(report, results, options.repeat);
+        if (!report)
+        {
+            cerr << "bench: cannot write " << options.output << endl;
+            success = false;
+        }
+    }
+    return success ? 0 : 1;
+}
+
+//***************************************************************************************************//
+//                                     FIXED-POINT VERIFIER                                          //
+//***************************************************************************************************//
+
+// Scales checked by --verify-fixed-point: 0 to FIXED_POINT_SWEEP_MAX in steps of 1/FIXED_POINT_SWEEP_STEPS
+const int FIXED_POINT_SWEEP_STEPS = 2000;
+const int FIXED_POINT_SWEEP_MAX = 4;
+
+// Divergent scales listed in the report before the rest are only counted
+const int FIXED_POINT_REPORT_LIMIT = 20;
+
+/**
+ * Builds BGR or BGRA pixels that put every channel value through every scale curve
+ * Each value appears in each channel next to two zeros, which darkens it under
+ * clarendon, and next to two 255s, which lightens it.
+ * @param channels 3 for BGR or 4 for BGRA
+ * @return the pixels, 1536 of them
+ */
+vector<uint8_t> fixed_point_probe(int channels)
+{
+    vector<uint8_t> pixels;
+    for (int c = 0; c < 256; c++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            for (int other : {0, 255})
+            {
+                uint8_t px[4] = {(uint8_t)other, (uint8_t)other, (uint8_t)other, (uint8_t)c};
+                px[a] = c;
+                pixels.insert(pixels.end(), px, px + channels);
+            }
+        }
+    }
+    return pixels;
+}
+
+/**
+ * Checks the fixed-point scale curves against the double-precision reference
+ * For every scale of the sweep and all 256 channel values it counts the curves
+ * where plain 16.16 arithmetic differs from the double formulas, lists the
+ * curves with no exact fixed-point version, which the vector kernels compute
+ * in doubles, and checks that the kernels give exactly the scalar tables for
+ * clarendon, lighten and darken.
+ * @param out where to write the report
+ * @return 0 if the kernels matched the tables for every scale, 1 otherwise
+ */
+int verify_fixed_point(ostream& out)
+{
+    struct KernelUnderTest
+    {
+        const char* name;
+        int process;
+        int channels;
+        SpanKernel kernel;
+    };
+    vector<KernelUnderTest> kernels;
+    for (int channels : {3, 4})
+    {
+        const KernelSet& active = active_kernels(channels);
+        kernels.push_back({active.name, 2, channels, active.clarendon});
+        kernels.push_back({active.name, 8, channels, active.lighten});
+        kernels.push_back({active.name, 9, channels, active.darken});
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    // The fixed-point kernels are the AVX2 ones, checked even when AVX-512 is preferred
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.push_back({"avx2", 2, 3, clarendon_avx2<3>});
+        kernels.push_back({"avx2", 8, 3, lighten_avx2<3>});
+        kernels.push_back({"avx2", 9, 3, darken_avx2<3>});
+        kernels.push_back({"avx2", 2, 4, clarendon_avx2<4>});
+        kernels.push_back({"avx2", 8, 4, lighten_avx2<4>});
+        kernels.push_back({"avx2", 9, 4, darken_avx2<4>});
+    }
+#endif
+
+    int scales = 0;
+    int nearest_divergent = 0;
+    int fallbacks = 0;
+    int kernel_mismatches = 0;
+    vector<uint8_t> probes[2] = {fixed_point_probe(3), fixed_point_probe(4)};
+    for (int k = 0; k <= FIXED_POINT_SWEEP_MAX * FIXED_POINT_SWEEP_STEPS; k++)
+    {
+        double scale = (double)k / FIXED_POINT_SWEEP_STEPS;
+        PreparedOp op = prepare_point_op({8, scale});
+        scales++;
+
+        // Plain 16.16 arithmetic: the nearest factor, truncating darken and rounding lighten up
+        uint32_t nearest = nearbyint(scale * (1 << FIXED_POINT_BITS));
+        for (uint8_t curve : {CURVE_DARKEN, CURVE_LIGHTEN})
+        {
+            bool lighten = curve == CURVE_LIGHTEN;
+            FixedCurve plain = {true, nearest, lighten ? 0u : 0xFFFFu};
+            int c = 0;
+            while (c < 256 && (uint8_t)fixed_curve_value(c, plain, lighten) == op.curves[curve][c])
+            {
+                c++;
+            }
+            nearest_divergent += c < 256;
+
+            // A curve with no exact version at all is what the vector kernels fall back on doubles for
+            if (!op.fixed[curve].exact && fallbacks++ < FIXED_POINT_REPORT_LIMIT)
+            {
+                c = min(c, 255);
+                out << "  scale " << scale << ": no exact fixed-point " << (lighten ? "lighten" : "darken")
+                    << " curve; factor " << nearest << " gives " << (int)(uint8_t)fixed_curve_value(c, plain, lighten)
+                    << " for " << c << " where doubles give " << (int)op.curves[curve][c] << "\n";
+            }
+        }
+
+        for (const KernelUnderTest& test : kernels)
+        {
+            if (test.kernel == nullptr)
+            {
+                continue;
+            }
+            op.process = test.process;
+            vector<uint8_t> expected = probes[test.channels - 3];
+            vector<uint8_t> actual = expected;
+            RowSpan span;
+            span.pixels = expected.data();
+            span.count = expected.size() / test.channels;
+            span.channels = test.channels;
+            if (test.process == 2)
+            {
+                apply_pixel_filter(span, ClarendonFilter{op.curves});
+            }
+            else
+            {
+                apply_pixel_filter(span, ChannelLutFilter{op.curves[test.process == 8 ? CURVE_LIGHTEN : CURVE_DARKEN]});
+            }
+            span.pixels = actual.data();
+            int done = test.kernel(span.pixels, span.count, op);
+
+            // A kernel must cover the probe up to less than one block, or it would pass by doing nothing
+            if (done < 0 || done > span.count || (span.count - done) * test.channels >= SPAN_KERNEL_BLOCK_BYTES)
+            {
+                kernel_mismatches++;
+                out << "  scale " << scale << ": " << test.name << " kernel for process " << test.process
+                    << " on " << test.channels * 8 << "-bit pixels handled " << done << " of " << span.count
+                    << " pixels\n";
+            }
+            else if (memcmp(expected.data(), actual.data(), (size_t)done * test.channels) != 0)
+            {
+                kernel_mismatches++;
+                out << "  scale " << scale << ": " << test.name << " kernel for process " << test.process
+                    << " on " << test.channels * 8 << "-bit pixels differs from the tables\n";
+            }
+        }
+    }
+    if (fallbacks > FIXED_POINT_REPORT_LIMIT)
+    {
+        out << "  ... and " << fallbacks - FIXED_POINT_REPORT_LIMIT << " more\n";
+    }
+
+    out << "scales checked:                 " << scales << " (0 to " << FIXED_POINT_SWEEP_MAX << " in steps of 1/"
+        << FIXED_POINT_SWEEP_STEPS << ", all 256 channel values each)\n"
+        << "plain 16.16 curves diverging:   " << nearest_divergent << " of " << 2 * scales << "\n"
+        << "curves left on doubles:         " << fallbacks << " of " << 2 * scales << "\n"
+        << "kernel mismatches:              " << kernel_mismatches << "\n";
+    return kernel_mismatches == 0 ? 0 : 1;
+}
+
+//***************************************************************************************************//
+//                                     THREAD POOL VERIFIER                                          //
+//***************************************************************************************************//
+
+// Row ranges run by --verify-thread-pool on each pool size, shared out between the callers
+const int THREAD_POOL_CHECK_RANGES = 3000;
+const int THREAD_POOL_CHECK_CALLERS = 4;
+
+// Largest row count and grain of a checked range; grains of 0 check the clamp to 1
+const int THREAD_POOL_CHECK_MAX_ROWS = 2000;
+const int THREAD_POOL_CHECK_MAX_GRAIN = 64;
+
+// Failed ranges listed in the report before the rest are only counted
+const int THREAD_POOL_REPORT_LIMIT = 20;
+
+/**
+ * Runs one row range through a pool and checks that every row ran exactly once
+ * A nested range passes each chunk it is given to the pool again, which must
+ * run it inline on the thread that got the chunk.
+ * @param pool    the pool under test
+ * @param count   number of rows
+ * @param grain   rows handed out at a time
+ * @param nested  whether each chunk goes through a nested call
+ * @param problem set to what went wrong
+ * @return true if the range ran correctly
+ */
+bool check_pool_range(ThreadPool& pool, int count, int grain, bool nested, string& problem)
+{
+    vector<atomic<int>> runs(count);
+    atomic<int> bad_ranges{0};
+    atomic<int> escaped{0};
+    auto mark = [&](int begin, int end)
+    {
+        if (begin < 0 || begin >= end || end > count)
+        {
+            bad_ranges++;
+            return;
+        }
+        for (int row = begin; row < end; row++)
+        {
+            runs[row]++;
+        }
+    };
+
+    pool.parallel_for(count, grain, [&](int begin, int end)
+    {
+        if (!nested)
+        {
+            mark(begin, end);
+            return;
+        }
+        thread::id owner = this_thread::get_id();
+        pool.parallel_for(end - begin, grain, [&](int inner_begin, int inner_end)
+        {
+            escaped += this_thread::get_id() != owner;
+            mark(begin + inner_begin, begin + inner_end);
+        });
+    });
+
+    int missed = 0;
+    int repeated = 0;
+    for (int row = 0; row < count; row++)
+    {
+        missed += runs[row] == 0;
+        repeated += runs[row] > 1;
+    }
+    if (missed == 0 && repeated == 0 && bad_ranges == 0 && escaped == 0)
+    {
+        return true;
+    }
+    ostringstream text;
+    text << count << " rows in grains of " << grain << (nested ? ", nested" : "") << ": " << missed << " missed, "
+         << repeated << " repeated, " << bad_ranges << " bad ranges, " << escaped << " nested chunks off their thread";
+    problem = text.str();
+    return false;
+}
+
+/**
+ * Checks that the thread pool runs every row of a range exactly once
+ * Pools of several sizes each get pseudo-random ranges and grains from callers
+ * on separate threads at once, and every fourth range makes nested calls. The
+ * sequences are fixed, so a failure repeats on the next run.
+ * @param out where to write the report
+ * @return 0 if every range ran correctly, 1 otherwise
+ */
+int verify_thread_pool(ostream& out)
+{
+    const int sizes[] = {1, 2, 3, 8};
+    int ranges = 0;
+    int failures = 0;
+    mutex report_mutex;
+    for (int threads : sizes)
+    {
+        ThreadPool pool(threads);
+        vector<thread> callers;
+        for (int caller = 0; caller < THREAD_POOL_CHECK_CALLERS; caller++)
+        {
+            callers.emplace_back([&, caller]
+            {
+                // A linear congruential sequence seeded by pool size and caller
+                uint64_t state = threads * THREAD_POOL_CHECK_CALLERS + caller + 1;
+                auto next = [&](int limit)
+                {
+                    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                    return (int)((state >> 33) % (limit + 1));
+                };
+                for (int k = caller; k < THREAD_POOL_CHECK_RANGES; k += THREAD_POOL_CHECK_CALLERS)
+                {
+                    int count = next(THREAD_POOL_CHECK_MAX_ROWS);
+                    int grain = next(THREAD_POOL_CHECK_MAX_GRAIN);
+                    string problem;
+                    if (!check_pool_range(pool, count, grain, k % 4 == 3, problem))
+                    {
+                        lock_guard<mutex> lock(report_mutex);
+                        if (failures++ < THREAD_POOL_REPORT_LIMIT)
+                        {
+                            out << "  pool of " << pool.size() << ": " << problem << "\n";
+                        }
+                    }
+                }
+            });
+        }
+        for (thread& caller : callers)
+        {
+            caller.join();
+        }
+        ranges += THREAD_POOL_CHECK_RANGES;
+    }
+    if (failures > THREAD_POOL_REPORT_LIMIT)
+    {
+        out << "  ... and " << failures - THREAD_POOL_REPORT_LIMIT << " more\n";
+    }
+
+    out << "pool sizes checked:             ";
+    for (size_t s = 0; s < size(sizes); s++)
+    {
+        out << (s > 0 ? ", " : "") << sizes[s];
+    }
+    out << " (" << THREAD_POOL_CHECK_CALLERS << " callers at once)\n"
+        << "row ranges run:                 " << ranges << " (up to " << THREAD_POOL_CHECK_MAX_ROWS
+        << " rows, every 4th nested)\n"
+        << "failed ranges:                  " << failures << "\n";
+    return failures == 0 ? 0 : 1;
+}
+
+//***************************************************************************************************//
+//                                       BATCH COMMAND LINE                                          //
+//***************************************************************************************************//
+
+// One step of a batch job; scale holds the scaling factor, the number of
+// turns or the X scale, and y_scale the Y scale of an enlarge
+struct BatchOp
+{
+    int process;
+    double scale;
+    double y_scale;
+};
+
+// A file to process
+struct BatchJob
+{
+    string input;
+    string output;
+    vector<BatchOp> ops;
+    int bits_per_pixel = 24;   // Depth of the output: 24, 32, or 0 to match the input
+    bool map_output = false;   // Write the output through a mapping of the file
+};
+
+/**
+ * Builds the cache key of a job from its input, operations and output depth
+ * @param pixel_hash the hash of the input pixels
+ * @param job        the job
+ * @return the key
+ */
+uint64_t result_key(uint64_t pixel_hash, const BatchJob& job)
+{
+    // Parameters are spelled out in full so every distinct double gets its own key
+    string text = "bpp " + to_string(job.bits_per_pixel) + ";";
+    char entry[96];
+    for (const BatchOp& op : job.ops)
+    {
+        snprintf(entry, sizeof(entry), "%d:%.17g:%.17g;", op.process, op.scale, op.y_scale);
+        text += entry;
+    }
+    return hash_bytes(text.data(), text.size(), pixel_hash);
+}
+
+// Names accepted by --op, with the process they run and their parameter count
+struct OpName
+{
+    const char* name;
+    int process;
+    int parameters;
+};
+
+const OpName OP_NAMES[] = {
+    {"vignette", 1, 0}, {"clarendon", 2, 1}, {"grayscale", 3, 0}, {"rotate", 5, 1},
+    {"enlarge", 6, 2}, {"contrast", 7, 0}, {"lighten", 8, 1}, {"darken", 9, 1}, {"bwrgb", 10, 0},
+};
+
+/**
+ * Parses a whole string as a number
+ * @param text  the text to parse
+ * @param value receives the number
+ * @return true if the text was a number and nothing else
+ */
+bool parse_number(const string& text, double& value)
+{
+    char* end = nullptr;
+    errno = 0;
+    value = strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0' && errno == 0 && isfinite(value);
+}
+
+/**
+ * Parses a comma separated list of operations such as "grayscale,lighten:0.5,enlarge:2x3"
+ * rotate takes an optional number of turns (default 1) and enlarge takes
+ * "XxY" or a single scale for both axes.
+ * @param text  the list to parse
+ * @param ops   receives the operations in order
+ * @param error receives a description of the first bad entry
+ * @return true if every entry was understood
+ */
+bool parse_ops(const string& text, vector<BatchOp>& ops, string& error)
+{
+    ops.clear();
+    size_t start = 0;
+    while (start <= text.size())
+    {
+        size_t comma = min(text.find(',', start), text.size());
+        string entry = text.substr(start, comma - start);
+        start = comma + 1;
+
+        size_t colon = entry.find(':');
+        string name = entry.substr(0, colon);
+        string argument = colon == string::npos ? "" : entry.substr(colon + 1);
+
+        const OpName* found = nullptr;
+        for (const OpName& op_name : OP_NAMES)
+        {
+            if (name == op_name.name)
+            {
+                found = &op_name;
+            }
+        }
+        if (found == nullptr)
+        {
+            error = "unknown operation '" + name + "'";
+            return false;
+        }
+
+        BatchOp op = {found->process, 0, 0};
+        bool valid = true;
+        if (found->parameters == 0)
+        {
+            valid = colon == string::npos;
+        }
+        else if (found->process == 5)
+        {
+            op.scale = 1;
+            // The range is checked first, as converting a double outside int's range is undefined
+            valid = colon == string::npos
+                    || (parse_number(argument, op.scale) && fabs(op.scale) <= INT_MAX && op.scale == trunc(op.scale));
+        }
+        else if (found->process == 6)
+        {
+            size_t by = argument.find('x');
+            valid = parse_number(argument.substr(0, by), op.scale)
+                    && (by == string::npos ? (op.y_scale = op.scale, true) : parse_number(argument.substr(by + 1), op.y_scale))
+                    && op.scale > 0 && op.y_scale > 0;
+        }
+        else
+        {
+            valid = parse_number(argument, op.scale);
+        }
+        if (!valid)
+        {
+            error = "bad parameter in '" + entry + "'";
+            return false;
+        }
+        ops.push_back(op);
+    }
+    return true;
+}
+
+/**
+ * Applies the pending point filters of a job to an image and forgets them
+ * @param pending the point filters, in order
+ * @param image   the image to filter in place
+ */
+void flush_point_ops(vector<PointOp>& pending, Image& image)
+{
+    if (!pending.empty())
+    {
+        StageTimer timer(STAGE_POINT_CHAIN, (uint64_t)image.width * image.height);
+        apply_point_chain(pending, image);
+        pending.clear();
+    }
+}
+
+/**
+ * Runs a job that never loads the whole image, if the job is one
+ * With stream set, a job made only of point filters, or of a single rotate or
+ * enlarge, is streamed. A lone rotate or enlarge also runs out of core when
+ * the images it would hold in memory exceed the budget of an automatic setup.
+ * @param job         the job to run
+ * @param stream      whether to stream jobs that allow it
+ * @param out_of_core the memory budget of out-of-core transforms
+ * @param error       receives a description of any failure
+ * @param handled     set to true if the job was run here
+ * @return true if the output was written
+ */
+bool produce_unloaded_result(const BatchJob& job, bool stream, const OutOfCoreOptions& out_of_core, string& error,
+                             bool& handled)
+{
+    vector<PointOp> pending;
+    for (const BatchOp& op : job.ops)
+    {
+        if (is_point_op(op.process))
+        {
+            pending.push_back({op.process, op.scale});
+        }
+    }
+
+    handled = true;
+    if (stream && pending.size() == job.ops.size())
+    {
+        return stream_point_chain(job.input, job.output, pending, &error, job.bits_per_pixel);
+    }
+    if (job.ops.size() == 1 && (job.ops[0].process == 5 || job.ops[0].process == 6))
+    {
+        const BatchOp& op = job.ops[0];
+        bool tiled = stream;
+        if (!tiled && out_of_core.automatic)
+        {
+            // A rotation holds the source and the result; an enlarge only the source
+            BmpInfo info;
+            string ignored;
+            int fd = open_bmp_stream(job.input, info, ignored);
+            uint64_t bytes = (uint64_t)info.width * info.height * (info.bits_per_pixel / 8);
+            tiled = ignored.empty() && bytes * (op.process == 5 ? 2 : 1) > out_of_core.memory_budget;
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+        if (tiled)
+        {
+            return transform_bmp_file(job.input, job.output, op.process, op.scale, op.y_scale, out_of_core,
+                                      &error, job.bits_per_pixel);
+        }
+    }
+    handled = false;
+    return false;
+}
+
+/**
+ * Checks whether a job ends with an enlarge, which is streamed into the output file
+ * @param job the job
+ * @return true if the last operation is an enlarge
+ */
+bool ends_with_enlarge(const BatchJob& job)
+{
+    return !job.ops.empty() && job.ops.back().process == 6;
+}
+
+/**
+ * Runs the operations of a job on a decoded image, up to what is left for writing
+ * Consecutive point filters are fused into a single pass. An enlarge as the
+ * last step is left for write_batch_result() to stream into the output file,
+ * and with map_output set, trailing point filters are left in pending to run
+ * on the rows after they are stored in the mapped output.
+ * @param job     the job
+ * @param image   the decoded input; receives the result
+ * @param scratch a second buffer to rotate and enlarge through; may be swapped with image
+ * @param pending receives the point filters left for writing
+ * @param error   receives a description of any failure
+ * @return true if the operations ran
+ */
+bool apply_batch_ops(const BatchJob& job, Image& image, Image& scratch, vector<PointOp>& pending, string& error)
+{
+    pending.clear();
+    size_t count = job.ops.size() - (ends_with_enlarge(job) ? 1 : 0);
+    for (size_t i = 0; i < count; i++)
+    {
+        const BatchOp& op = job.ops[i];
+        if (is_point_op(op.process))
+        {
+            pending.push_back({op.process, op.scale});
+            continue;
+        }
+        flush_point_ops(pending, image);
+
+        if (op.process == 5)
+        {
+            StageTimer timer(STAGE_ROTATE, (uint64_t)image.width * image.height);
+            int turns = (((int)op.scale % 4) + 4) % 4;
+            if (turns == 2)
+            {
+                rotate_180_in_place(image);
+            }
+            else if (turns != 0)
+            {
+                if (!rotate_quarter_into(image, turns == 1, scratch))
+                {
+                    error = "out of memory";
+                    return false;
+                }
+                swap(image, scratch);
+            }
+        }
+        else
+        {
+            if (!process_6_into(image, op.scale, op.y_scale, scratch))
+            {
+                error = "image too large to enlarge";
+                return false;
+            }
+            swap(image, scratch);
+        }
+    }
+    if (!job.map_output || ends_with_enlarge(job))
+    {
+        flush_point_ops(pending, image);
+    }
+    return true;
+}
+
+/**
+ * Writes the output of a job from the image apply_batch_ops() left
+ * @param job     the job
+ * @param image   the image to write
+ * @param pending the point filters still to apply, which are only left with map_output set
+ * @param error   receives a description of any failure
+ * @return true if the output was written
+ */
+bool write_batch_result(const BatchJob& job, Image& image, const vector<PointOp>& pending, string& error)
+{
+    bool written;
+    if (ends_with_enlarge(job))
+    {
+        const BatchOp& op = job.ops.back();
+        written = write_enlarged_bmp(job.output, image, op.scale, op.y_scale, nullptr, job.bits_per_pixel);
+    }
+    else if (job.map_output)
+    {
+        written = write_mapped_bmp(job.output, image, pending, nullptr, job.bits_per_pixel);
+    }
+    else
+    {
+        written = write_bmp(job.output, image, nullptr, job.bits_per_pixel);
+    }
+    if (!written)
+    {
+        error = string("cannot write output: ") + strerror(errno);
+    }
+    return written;
+}
+
+// Where the time of one job went, in seconds
+struct JobTimings
+{
+    double decode = 0;
+    double filter = 0;
+    double encode = 0;
+    bool loaded = false;  // false when served by the cache or run without loading the image
+    bool cached = false;
+};
+
+/**
+ * Produces the output of one batch job
+ * Jobs that allow it run without loading the image; the rest are decoded, run
+ * through apply_batch_ops() and written by write_batch_result(). Each thread
+ * decodes into, and rotates or enlarges through, its own pair of buffers that
+ * are kept between jobs, so once they have grown to the largest image no pixel
+ * buffers are allocated. 32-bit inputs stay BGRA throughout, so a 32-bit
+ * output is written without repacking.
+ * @param job         the job to run
+ * @param stream      whether to stream jobs that allow it
+ * @param out_of_core the memory budget of out-of-core transforms
+ * @param error       receives a description of any failure
+ * @param timings     receives the time of each step, or null
+ * @return true if the output was written
+ */
+bool produce_batch_result(const BatchJob& job, bool stream, const OutOfCoreOptions& out_of_core, string& error,
+                          JobTimings* timings = nullptr)
+{
+    bool handled;
+    bool success = produce_unloaded_result(job, stream, out_of_core, error, handled);
+    if (handled)
+    {
+        return success;
+    }
+
+    thread_local Image image;
+    thread_local Image scratch;
+    vector<PointOp> pending;
+    JobTimings unused;
+    JobTimings& steps = timings != nullptr ? *timings : unused;
+    auto last = chrono::steady_clock::now();
+    auto lap = [&](double& seconds) {
+        auto now = chrono::steady_clock::now();
+        seconds = chrono::duration<double>(now - last).count();
+        last = now;
+    };
+    steps.loaded = true;
+    success = read_bmp_into(job.input, image, &error);
+    lap(steps.decode);
+    success = success && apply_batch_ops(job, image, scratch, pending, error);
+    lap(steps.filter);
+    success = success && write_batch_result(job, image, pending, error);
+    lap(steps.encode);
+    return success;
+}
+
+/**
+ * Runs one batch job, serving it from the result cache when possible
+ * @param job         the job to run
+ * @param stream      whether to stream jobs that allow it
+ * @param out_of_core the memory budget of out-of-core transforms
+ * @param cache       the result cache, or null to always process
+ * @param error       receives a description of any failure
+ * @param timings     receives the time of each step, or null
+ * @return true if the output was written
+ */
+bool run_batch_job(const BatchJob& job, bool stream, const OutOfCoreOptions& out_of_core, ResultCache* cache,
+                   string& error, JobTimings* timings = nullptr)
+{
+    uint64_t pixel_hash;
+    if (cache == nullptr || !hash_bmp_pixels(job.input, pixel_hash, error))
+    {
+        // An unreadable input fails the same way with or without the cache
+        error.clear();
+        return produce_batch_result(job, stream, out_of_core, error, timings);
+    }
+
+    uint64_t key = result_key(pixel_hash, job);
+    if (cache->fetch(key, job.output))
+    {
+        if (timings != nullptr)
+        {
+            timings->cached = true;
+        }
+        return true;
+    }
+    if (!produce_batch_result(job, stream, out_of_core, error, timings))
+    {
+        return false;
+    }
+    cache->store(key, job.output);
+    return true;
+}
+
+// Threads and queue sizes of the batch pipeline
+struct PipelineOptions
+{
+    int decode_threads = 1;
+    int filter_threads = 1;   // Each filters whole images using the shared row pool
+    int encode_threads = 1;
+    int queue_depth = 2;      // Images each queue holds between two stages
+};
+
+// Receives the outcome of one job: its index, whether it succeeded, a
+// description of any failure and its time from start to finish
+typedef function<void(int job, bool success, const string& message, double seconds)> JobReport;
+
+// An image on its way through the pipeline
+struct PipelineItem
+{
+    int job = -1;
+    Image image;
+    vector<PointOp> pending;
+    uint64_t key = 0;          // Result cache key
+    bool cacheable = false;    // Store the output in the cache once it is written
+    chrono::steady_clock::time_point start;
+};
+
+/**
+ * Asks the kernel to start reading a file into the page cache
+ * @param filename the file that will be read soon
+ */
+void prefetch_file(const string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+/**
+ * Runs batch jobs through a decode, filter and encode pipeline
+ * Each stage has its own threads, joined by bounded queues, so one image is
+ * read while the one before it is filtered and the one before that is
+ * written. The decode stage asks the kernel to read ahead the input after the
+ * one it is decoding. Decode and encode threads run their row loops serially,
+ * leaving the shared row pool to the filter stage. Jobs served by the cache
+ * or that never load the image finish in the decode stage. Image buffers are
+ * handed back from the encode stage to the decode stage, so the pipeline
+ * stops allocating once every buffer in flight has grown to the largest image.
+ * The queue statistics are left in pipeline_queues.
+ * @param jobs        the jobs
+ * @param stream      whether to stream jobs that allow it
+ * @param out_of_core the memory budget of out-of-core transforms
+ * @param cache       the result cache, or null to always process
+ * @param options     the threads and queue sizes
+ * @param report      called once for every job as it finishes
+ */
+void run_batch_pipeline(const vector<BatchJob>& jobs, bool stream, const OutOfCoreOptions& out_of_core,
+                        ResultCache* cache, const PipelineOptions& options, const JobReport& report)
+{
+    BoundedQueue<PipelineItem> decoded(options.queue_depth);
+    BoundedQueue<PipelineItem> filtered(options.queue_depth);
+    atomic<int> next_job{0};
+    atomic<int> decoders_left{options.decode_threads};
+    atomic<int> filters_left{options.filter_threads};
+    mutex spare_mutex;
+    vector<Image> spare;
+
+    auto seconds_since = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+    auto finish = [&](PipelineItem& item, bool success, const string& message) {
+        report(item.job, success, message, seconds_since(item.start));
+        if (item.image.data)
+        {
+            lock_guard<mutex> lock(spare_mutex);
+            spare.push_back(move(item.image));
+        }
+    };
+
+    auto decode = [&] {
+        ThreadPool::run_serially_on_this_thread();
+        for (int i; (i = next_job++) < (int)jobs.size(); )
+        {
+            if (i + options.decode_threads < (int)jobs.size())
+            {
+                prefetch_file(jobs[i + options.decode_threads].input);
+            }
+            const BatchJob& job = jobs[i];
+            PipelineItem item;
+            item.job = i;
+            item.start = chrono::steady_clock::now();
+            string message;
+
+            uint64_t pixel_hash;
+            if (cache != nullptr && hash_bmp_pixels(job.input, pixel_hash, message))
+            {
+                item.key = result_key(pixel_hash, job);
+                if (cache->fetch(item.key, job.output))
+                {
+                    finish(item, true, "");
+                    continue;
+                }
+                item.cacheable = true;
+            }
+            message.clear();
+
+            bool handled;
+            bool success = produce_unloaded_result(job, stream, out_of_core, message, handled);
+            if (handled)
+            {
+                if (success && item.cacheable)
+                {
+                    cache->store(item.key, job.output);
+                }
+                finish(item, success, message);
+                continue;
+            }
+
+            {
+                lock_guard<mutex> lock(spare_mutex);
+                if (!spare.empty())
+                {
+                    item.image = move(spare.back());
+                    spare.pop_back();
+                }
+            }
+            if (!read_bmp_into(job.input, item.image, &message))
+            {
+                finish(item, false, message);
+                continue;
+            }
+            decoded.push(move(item));
+        }
+        if (--decoders_left == 0)
+        {
+            decoded.close();
+        }
+    };
+
+    auto filter = [&] {
+        Image scratch;
+        PipelineItem item;
+        while (decoded.pop(item))
+        {
+            // Point filters left for a mapped output run here too, on the shared pool
+            string message;
+            if (!apply_batch_ops(jobs[item.job], item.image, scratch, item.pending, message))
+            {
+                finish(item, false, message);
+                continue;
+            }
+            flush_point_ops(item.pending, item.image);
+            filtered.push(move(item));
+        }
+        if (--filters_left == 0)
+        {
+            filtered.close();
+        }
+    };
+
+    auto encode = [&] {
+        ThreadPool::run_serially_on_this_thread();
+        PipelineItem item;
+        while (filtered.pop(item))
+        {
+            string message;
+            const BatchJob& job = jobs[item.job];
+            bool success = write_batch_result(job, item.image, item.pending, message);
+            if (success && item.cacheable)
+            {
+                cache->store(item.key, job.output);
+            }
+            finish(item, success, message);
+        }
+    };
+
+    vector<thread> threads;
+    for (int i = 0; i < options.decode_threads; i++)
+    {
+        threads.emplace_back(decode);
+    }
+    for (int i = 0; i < options.filter_threads; i++)
+    {
+        threads.emplace_back(filter);
+    }
+    for (int i = 0; i < options.encode_threads; i++)
+    {
+        threads.emplace_back(encode);
+    }
+    for (thread& stage_thread : threads)
+    {
+        stage_thread.join();
+    }
+    pipeline_queues[0] = decoded.statistics();
+    pipeline_queues[1] = filtered.statistics();
+}
+
+/**
+ * Parses one job line: input, output and an optional operation list
+ * @param line        the line
+ * @param default_ops the operations if the line has no list of its own
+ * @param job         receives the job; its input is left empty for blank lines and lines starting with #
+ * @param error       receives a description of a bad line
+ * @return true if the line was understood
+ */
+bool parse_job_line(const string& line, const vector<BatchOp>& default_ops, BatchJob& job, string& error)
+{
+    istringstream fields(line);
+    string ops, extra;
+    job.input.clear();
+    if (!(fields >> job.input) || job.input[0] == '#')
+    {
+        job.input.clear();
+        return true;
+    }
+    if (!(fields >> job.output) || fields >> ops >> extra)
+    {
+        error = "expected input, output and optional operations";
+        return false;
+    }
+    job.ops = default_ops;
+    return ops.empty() || parse_ops(ops, job.ops, error);
+}
+
+/**
+ * Reads a manifest of jobs, one per line: input, output and an optional
+ * operation list that replaces the --op list. Blank lines and lines starting
+ * with # are skipped.
+ * @param filename   the manifest file
+ * @param default_ops the operations of lines without their own list
+ * @param jobs       receives the jobs
+ * @param error      receives a description of the first bad line
+ * @return true if the whole manifest was understood
+ */
+bool read_manifest(const string& filename, const vector<BatchOp>& default_ops, vector<BatchJob>& jobs, string& error)
+{
+    ifstream manifest(filename);
+    if (!manifest)
+    {
+        error = "cannot open manifest " + filename;
+        return false;
+    }
+
+    string line;
+    for (int number = 1; getline(manifest, line); number++)
+    {
+        BatchJob job;
+        if (!parse_job_line(line, default_ops, job, error))
+        {
+            error = filename + ":" + to_string(number) + ": " + error;
+            return false;
+        }
+        if (!job.input.empty())
+        {
+            jobs.push_back(job);
+        }
+    }
+    return true;
+}
+
+// Longest request line the job daemon accepts
+const size_t DAEMON_MAX_LINE = 1 << 16;
+// Most clients the job daemon serves at once
+const int DAEMON_MAX_CLIENTS = 256;
+
+// What the job daemon runs every request with
+struct DaemonOptions
+{
+    vector<BatchOp> default_ops;      // operations of requests without their own list
+    int bits_per_pixel = 24;
+    bool map_output = false;
+    bool stream = false;
+    OutOfCoreOptions out_of_core;
+    ResultCache* cache = nullptr;
+    int workers = 1;                  // jobs run at once
+    bool verbose = false;
+};
+
+// A job handed from a client's connection to the daemon's workers
+struct DaemonRequest
+{
+    BatchJob job;
+    chrono::steady_clock::time_point received;
+    promise<string> reply;
+};
+
+// The open connections of the job daemon, shared with the thread of each
+// client so it can leave after the daemon has stopped waiting for it
+struct DaemonClients
+{
+    mutex clients_mutex;
+    condition_variable all_closed;
+    vector<int> sockets;
+    unordered_set<string> busy_outputs;        // outputs of the jobs in flight, from canonical_path()
+    unordered_multiset<string> busy_inputs;    // inputs of the jobs in flight, from canonical_path()
+    bool draining = false;
+};
+
+// Write end of the pipe that wakes the daemon's accept loop; used by signal handlers
+int daemon_wake_fd = -1;
+
+/**
+ * Asks the job daemon to drain; safe to call from a signal handler
+ * @param signal the signal that was received, unused
+ */
+void wake_daemon(int)
+{
+    int saved_errno = errno;
+    char byte = 0;
+    if (write(daemon_wake_fd, &byte, 1) < 0)
+    {
+        // The pipe is full, so the daemon is already being woken
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Reads one line from a socket
+ * @param fd     the socket
+ * @param buffer bytes read past the last line, kept between calls
+ * @param line   receives the line without its end
+ * @return false at the end of the input or on a line longer than DAEMON_MAX_LINE
+ */
+bool read_socket_line(int fd, string& buffer, string& line)
+{
+    char chunk[4096];
+    size_t end;
+    while ((end = buffer.find('\n')) == string::npos)
+    {
+        if (buffer.size() > DAEMON_MAX_LINE)
+        {
+            return false;
+        }
+        ssize_t got = read(fd, chunk, sizeof(chunk));
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            // A last line without an end still counts
+            if (buffer.empty())
+            {
+                return false;
+            }
+            buffer += '\n';
+        }
+        else
+        {
+            buffer.append(chunk, got);
+        }
+    }
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 1);
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.pop_back();
+    }
+    return true;
+}
+
+/**
+ * Writes a whole string to a socket, without raising SIGPIPE if the peer has gone
+ * @param fd   the socket
+ * @param text what to write
+ * @return true if all of it was written
+ */
+bool send_all(int fd, const string& text)
+{
+    size_t done = 0;
+    while (done < text.size())
+    {
+        ssize_t sent = send(fd, text.data() + done, text.size() - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        done += sent;
+    }
+    return true;
+}
+
+/**
+ * Formats the reply to a finished job
+ * @param success whether the output was written
+ * @param message the error of a failed job
+ * @param timings where the time of the job went
+ * @param queued  seconds the job waited for a worker
+ * @param total   seconds from receiving the job to finishing it
+ * @return "ok" with the times in milliseconds, or "error" and the message
+ */
+string format_job_reply(bool success, const string& message, const JobTimings& timings, double queued, double total)
+{
+    ostringstream reply;
+    if (!success)
+    {
+        reply << "error " << (message.empty() ? "failed" : message);
+        return reply.str();
+    }
+    reply << fixed << setprecision(3) << "ok total_ms=" << total * 1000 << " queued_ms=" << queued * 1000;
+    if (timings.cached)
+    {
+        reply << " cached";
+    }
+    else if (timings.loaded)
+    {
+        reply << " decode_ms=" << timings.decode * 1000 << " filter_ms=" << timings.filter * 1000
+              << " encode_ms=" << timings.encode * 1000;
+    }
+    else
+    {
+        reply << " streamed";
+    }
+    return reply.str();
+}
+
+/**
+ * Finds the one name of a file however it is spelled
+ * The directory part is resolved with realpath(), so "a/../x.bmp" and a
+ * path through a linked directory name the same file. A file that is
+ * itself a symbolic link is resolved only when asked: outputs are renamed
+ * over the link, while inputs are read through it.
+ * @param path          the path, relative to the working directory or absolute
+ * @param follow_target whether to resolve the file itself as well
+ * @return the canonical path, or the path unchanged if its directory does not exist
+ */
+string canonical_path(const string& path, bool follow_target)
+{
+    char resolved[PATH_MAX];
+    if (follow_target && realpath(path.c_str(), resolved) != nullptr)
+    {
+        return resolved;
+    }
+    size_t slash = path.find_last_of('/');
+    string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    if (realpath(directory.c_str(), resolved) == nullptr)
+    {
+        return path;
+    }
+    string name = path.substr(slash == string::npos ? 0 : slash + 1);
+    return string(resolved) + (resolved[1] != '\0' ? "/" : "") + name;
+}
+
+/**
+ * Answers one request line of a daemon client
+ * Besides job lines there are two commands: "ping", answered with "ok", and
+ * "drain", which makes the daemon finish the jobs in flight and exit.
+ * @param line    the request
+ * @param clients the daemon's connections
+ * @param queue   where jobs are handed to the workers
+ * @param options what jobs are run with
+ * @return the reply, or an empty string for blank lines and comments
+ */
+string answer_daemon_request(const string& line, DaemonClients& clients, BoundedQueue<DaemonRequest>& queue,
+                             const DaemonOptions& options)
+{
+    istringstream fields(line);
+    string command, extra;
+    if (fields >> command && !(fields >> extra))
+    {
+        if (command == "ping")
+        {
+            return "ok";
+        }
+        if (command == "drain")
+        {
+            wake_daemon(0);
+            return "ok draining";
+        }
+    }
+
+    DaemonRequest request;
+    string error;
+    if (!parse_job_line(line, options.default_ops, request.job, error))
+    {
+        return "error " + error;
+    }
+    if (request.job.input.empty())
+    {
+        return "";
+    }
+    if (request.job.ops.empty())
+    {
+        return "error no operations given";
+    }
+    request.job.bits_per_pixel = options.bits_per_pixel;
+    request.job.map_output = options.map_output;
+    request.received = chrono::steady_clock::now();
+    string input = canonical_path(request.job.input, true);
+    string output = canonical_path(request.job.output, false);
+    {
+        // A job may not write a file another job in flight writes or reads, nor read one it writes
+        lock_guard<mutex> lock(clients.clients_mutex);
+        if (clients.draining)
+        {
+            return "error daemon is draining";
+        }
+        if (clients.busy_outputs.count(output) != 0 || clients.busy_outputs.count(input) != 0)
+        {
+            return "error another job is writing " + (clients.busy_outputs.count(output) != 0 ? output : input);
+        }
+        if (clients.busy_inputs.count(output) != 0)
+        {
+            return "error another job is reading " + output;
+        }
+        clients.busy_outputs.insert(output);
+        clients.busy_inputs.insert(input);
+    }
+
+    future<string> reply = request.reply.get_future();
+    string answer = queue.push(move(request)) ? reply.get() : "error daemon is draining";
+    lock_guard<mutex> lock(clients.clients_mutex);
+    clients.busy_outputs.erase(output);
+    clients.busy_inputs.erase(clients.busy_inputs.find(input));
+    return answer;
+}
+
+/**
+ * Serves one client of the job daemon until it disconnects or the daemon drains
+ * Requests on one connection are answered in order, one reply line each.
+ * @param fd      the client's socket, closed on return
+ * @param clients the daemon's connections
+ * @param queue   where jobs are handed to the workers
+ * @param options what jobs are run with
+ */
+void serve_daemon_client(int fd, shared_ptr<DaemonClients> clients, BoundedQueue<DaemonRequest>& queue,
+                         const DaemonOptions& options)
+{
+    string buffer, line;
+    while (read_socket_line(fd, buffer, line))
+    {
+        string reply = answer_daemon_request(line, *clients, queue, options);
+        if (!reply.empty() && !send_all(fd, reply + "\n"))
+        {
+            break;
+        }
+    }
+
+    // The socket is closed under the lock so the daemon never shuts down a reused descriptor
+    lock_guard<mutex> lock(clients->clients_mutex);
+    clients->sockets.erase(find(clients->sockets.begin(), clients->sockets.end(), fd));
+    close(fd);
+    clients->all_closed.notify_all();
+}
+
+/**
+ * Creates a Unix domain socket that only this user can connect to and listens on it
+ * A socket file left behind by a daemon that is no longer running is replaced.
+ * @param path  where to create the socket
+ * @param error receives a description of any failure
+ * @return the listening socket, or -1 on failure
+ */
+int listen_unix_socket(const string& path, string& error)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        error = "socket path is empty or too long";
+        return -1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(077);
+    bool bound = fd >= 0 && bind(fd, (sockaddr*)&address, sizeof(address)) == 0;
+    if (fd >= 0 && !bound && errno == EADDRINUSE)
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool stale = probe >= 0 && connect(probe, (sockaddr*)&address, sizeof(address)) != 0 && errno == ECONNREFUSED;
+        if (probe >= 0)
+        {
+            close(probe);
+        }
+        bound = stale && unlink(path.c_str()) == 0 && bind(fd, (sockaddr*)&address, sizeof(address)) == 0;
+        errno = stale ? errno : EADDRINUSE;
+    }
+    umask(old_mask);
+    if (!bound || listen(fd, SOMAXCONN) != 0)
+    {
+        error = "cannot listen on " + path + ": " + strerror(errno);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Runs the job daemon: accepts jobs over a Unix domain socket until told to drain
+ * Clients send lines in the manifest format, "input output [operations]",
+ * and get one line back for each: "ok" followed by the milliseconds spent in
+ * total, waiting for a worker, and decoding, filtering and encoding, or
+ * "error" and a description. Relative paths are taken from the daemon's
+ * working directory. Each client has a thread of its own and any number may
+ * be connected; their jobs share a fixed set of workers, whose image buffers,
+ * like the row thread pool and the buffer pool, stay warm between jobs.
+ * SIGINT, SIGTERM or a "drain" request stop it accepting: the jobs in flight
+ * finish and are answered, later requests are refused, and the daemon
+ * returns once every client has disconnected.
+ * @param path    where to create the socket
+ * @param options what jobs are run with
+ * @param log     where to report the daemon's progress
+ * @return 0 after draining, 1 if the socket could not be set up
+ */
+int serve_jobs(const string& path, const DaemonOptions& options, ostream& log)
+{
+    string error;
+    int listener = listen_unix_socket(path, error);
+    int wake[2];
+    if (listener < 0 || pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        log << (listener < 0 ? error : string("cannot create pipe: ") + strerror(errno)) << endl;
+        if (listener >= 0)
+        {
+            close(listener);
+            unlink(path.c_str());
+        }
+        return 1;
+    }
+
+    daemon_wake_fd = wake[1];
+    struct sigaction action, old_interrupt, old_terminate;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wake_daemon;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &old_interrupt);
+    sigaction(SIGTERM, &action, &old_terminate);
+
+    shared_ptr<DaemonClients> clients = make_shared<DaemonClients>();
+    BoundedQueue<DaemonRequest> queue(options.workers * 2);
+    mutex log_mutex;
+    auto work = [&] {
+        if (options.workers > 1)
+        {
+            // Several jobs at once share the cores between them instead of between rows
+            ThreadPool::run_serially_on_this_thread();
+        }
+        DaemonRequest request;
+        while (queue.pop(request))
+        {
+            auto start = chrono::steady_clock::now();
+            JobTimings timings;
+            string message;
+            bool success = run_batch_job(request.job, options.stream, options.out_of_core, options.cache, message,
+                                         &timings);
+            auto end = chrono::steady_clock::now();
+            string reply = format_job_reply(success, message, timings,
+                                            chrono::duration<double>(start - request.received).count(),
+                                            chrono::duration<double>(end - request.received).count());
+            if (options.verbose || !success)
+            {
+                lock_guard<mutex> lock(log_mutex);
+                log << request.job.input << " -> " << request.job.output << ": " << reply << endl;
+            }
+            request.reply.set_value(reply);
+        }
+    };
+    default_pool();
+    vector<thread> workers;
+    for (int i = 0; i < options.workers; i++)
+    {
+        workers.emplace_back(work);
+    }
+    if (options.verbose)
+    {
+        log << "serving on " << path << " with " << options.workers << " workers" << endl;
+    }
+
+    pollfd waiting[2] = {{listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+    while (true)
+    {
+        if (poll(waiting, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            log << "cannot wait for clients: " << strerror(errno) << endl;
+            break;
+        }
+        if (waiting[1].revents != 0)
+        {
+            break;
+        }
+        int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+        {
+            continue;
+        }
+        lock_guard<mutex> lock(clients->clients_mutex);
+        if ((int)clients->sockets.size() >= DAEMON_MAX_CLIENTS)
+        {
+            send_all(client, "error too many clients\n");
+            close(client);
+            continue;
+        }
+        clients->sockets.push_back(client);
+        thread(serve_daemon_client, client, clients, ref(queue), cref(options)).detach();
+    }
+
+    // Drain: stop accepting, let every client finish its job in flight, then stop the workers
+    if (options.verbose)
+    {
+        log << "draining" << endl;
+    }
+    close(listener);
+    unlink(path.c_str());
     {
-        arr[offset+i] = (unsigned char)(value>>(i*8));
+        unique_lock<mutex> lock(clients->clients_mutex);
+        clients->draining = true;
+        for (int fd : clients->sockets)
+        {
+            shutdown(fd, SHUT_RD);
+        }
+        clients->all_closed.wait(lock, [&] { return clients->sockets.empty(); });
+    }
+    queue.close();
+    for (thread& worker : workers)
+    {
+        worker.join();
     }
+
+    sigaction(SIGINT, &old_interrupt, nullptr);
+    sigaction(SIGTERM, &old_terminate, nullptr);
+    daemon_wake_fd = -1;
+    close(wake[0]);
+    close(wake[1]);
+    return 0;
 }
 
 /**
- * Write the input image to a BMP file name specified
- * @param filename The BMP file name to save the image to
- * @param image    The input image to save
- * @return True if successful and false otherwise
+ * Makes a relative path absolute against the working directory
+ * @param path the path
+ * @return the absolute path
  */
-bool write_image(string filename, const vector<vector<Pixel>>& image)
+string absolute_path(const string& path)
 {
-    // Get the image width and height in pixels
-    int width_pixels = image[0].size();
-    int height_pixels = image.size();
-
-    // Calculate the width in bytes incorporating padding (4 byte alignment)
-    int width_bytes = width_pixels * 3;
-    int padding_bytes = 0;
-    padding_bytes = (4 - width_bytes % 4) % 4;
-    width_bytes = width_bytes + padding_bytes;
-
-    // Pixel array size in bytes, including padding
-    int array_bytes = width_bytes * height_pixels;
-
-    // Open a file stream for writing to a binary file
-    fstream stream;
-    stream.open(filename, ios::out | ios::binary);
-
-    // If there was a problem opening the file, return false
-    if (!stream.is_open())
+    char directory[PATH_MAX];
+    if (path.empty() || path[0] == '/' || getcwd(directory, sizeof(directory)) == nullptr)
     {
-        return false;
+        return path;
     }
+    return string(directory) + "/" + path;
+}
 
-    // Create the BMP and DIB Headers
-    const int BMP_HEADER_SIZE = 14;
-    const int DIB_HEADER_SIZE = 40;
-    unsigned char bmp_header[BMP_HEADER_SIZE] = {0};
-    unsigned char dib_header[DIB_HEADER_SIZE] = {0};
-
-    // BMP Header
-    set_bytes(bmp_header,  0, 1, 'B');              // ID field
-    set_bytes(bmp_header,  1, 1, 'M');              // ID field
-    set_bytes(bmp_header,  2, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE+array_bytes); // Size of BMP file
-    set_bytes(bmp_header,  6, 2, 0);                // Reserved
-    set_bytes(bmp_header,  8, 2, 0);                // Reserved
-    set_bytes(bmp_header, 10, 4, BMP_HEADER_SIZE+DIB_HEADER_SIZE); // Pixel array offset
-
-    // DIB Header
-    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
-    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
-    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
-    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
-    set_bytes(dib_header, 14, 2, 24);               // Number of bits per pixel
-    set_bytes(dib_header, 16, 4, 0);                // Compression method (0=BI_RGB)
-    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)                     
-    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
-    set_bytes(dib_header, 32, 4, 0);                // Number of colors in palette
-    set_bytes(dib_header, 36, 4, 0);                // Number of important colors
-
-    // Write the BMP and DIB Headers to the file
-    stream.write((char*)bmp_header, sizeof(bmp_header));
-    stream.write((char*)dib_header, sizeof(dib_header));
-
-    // Initialize pixel and padding
-    unsigned char pixel[3] = {0};
-    unsigned char padding[3] = {0};
-
-    // Pixel Array (Left to right, bottom to top, with padding)
-    for (int h = height_pixels - 1; h >= 0; h--)
+/**
+ * Sends requests to a job daemon and prints its replies
+ * Each line is sent as it is, except that relative input and output paths
+ * are made absolute, since the daemon runs in a directory of its own. Every
+ * reply is printed after the input it answers.
+ * @param path     the daemon's socket
+ * @param requests lines in the manifest format, or daemon commands
+ * @param out      where to print the replies
+ * @param log      where to report failures
+ * @return 0 if every job succeeded, 1 otherwise
+ */
+int submit_jobs(const string& path, istream& requests, ostream& out, ostream& log)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    int fd = path.size() < sizeof(address.sun_path) ? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+    memcpy(address.sun_path, path.c_str(), min(path.size(), sizeof(address.sun_path) - 1));
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
     {
-        for (int w = 0; w < width_pixels; w++)
+        log << "cannot connect to " << path << ": " << strerror(fd < 0 ? ENAMETOOLONG : errno) << endl;
+        if (fd >= 0)
         {
-            // Write the pixel (Blue, Green, Red)
-            pixel[0] = image[h][w].blue;
-            pixel[1] = image[h][w].green;
-            pixel[2] = image[h][w].red;
-            stream.write((char*)pixel, 3);
+            close(fd);
         }
-        // Write the padding bytes
-        stream.write((char *)padding, padding_bytes);
+        return 1;
     }
 
-    // Close the stream and return true
-    stream.close();
-    return true;
-}
-
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
-{
-    int num_rows = image.size();//rows = height
-    int num_columns = image[0].size();// colums = width
-    
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    for (int row = 0; row<num_rows; row++)
+    int status = 0;
+    string line, buffer, reply;
+    while (getline(requests, line))
     {
-        for (int col = 0; col< num_columns; col++)
+        istringstream fields(line);
+        string input, output, ops, extra;
+        if (!(fields >> input) || input[0] == '#')
         {
-            int blue_color = image[row][col].blue;
-            int green_color = image[row][col].green;
-            int red_color = image[row][col].red;
-            
-            double distance = sqrt(pow((col - (num_columns/2)),2)+pow((row - (num_rows/2)),2));
-            double scaling_factor = (num_rows - distance)/num_rows;
-            int newred = red_color*scaling_factor;
-            int newblue =  blue_color*scaling_factor;
-            int newgreen = green_color*scaling_factor;
-            
-            new_image[row][col].blue = newblue;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].red = newred;
+            continue;
+        }
+        if (fields >> output && !(fields >> ops >> extra))
+        {
+            line = absolute_path(input) + " " + absolute_path(output) + (ops.empty() ? "" : " " + ops);
+        }
+        if (!send_all(fd, line + "\n") || !read_socket_line(fd, buffer, reply))
+        {
+            log << "connection to " << path << " closed" << endl;
+            status = 1;
+            break;
+        }
+        out << input << ": " << reply << endl;
+        if (reply.compare(0, 2, "ok") != 0)
+        {
+            status = 1;
         }
     }
+    close(fd);
+    return status;
+}
 
-    return new_image;
+/**
+ * Prints the command line usage
+ * @param out     where to print it
+ * @param program the name the program was run as
+ */
+void print_usage(ostream& out, const char* program)
+{
+    out << "usage: " << program << " --op LIST [options] -o DIR FILE...\n"
+        << "       " << program << " [--op LIST] [options] --manifest FILE\n"
+        << "       " << program << " [--op LIST] [options] --serve SOCKET\n"
+        << "       " << program << " --submit SOCKET < REQUESTS\n"
+        << "       " << program << "                (interactive menu)\n"
+        << "\n"
+        << "operations (applied in order, separated by commas):\n"
+        << "  vignette, clarendon:F, grayscale, rotate[:N], enlarge:XxY, contrast,\n"
+        << "  lighten:F, darken:F, bwrgb\n"
+        << "\n"
+        << "options:\n"
+        << "  -o DIR           write each FILE to DIR under the same name\n"
+        << "  --manifest FILE  read 'input output [operations]' jobs from FILE\n"
+        << "  -j N             process N files at once (default: hardware threads)\n"
+        << "  --threads N      threads per image when one file runs at a time\n"
+        << "  --stream         stream point filters, rotations and enlarges without loading images\n"
+        << "  --memory-budget MB  rotate and enlarge images larger than MB megabytes out of core\n"
+        << "  --scratch-dir DIR   where out-of-core rotations spill tiles (default: next to the output)\n"
+        << "  --bpp N          write 24 or 32-bit files, or 'same' as each input (default 24)\n"
+        << "  --mmap-output    encode rows in parallel straight into a mapping of each output\n"
+        << "  --pipeline       decode, filter and encode on separate threads joined by queues\n"
+        << "  --stage-threads D,F,E  pipeline threads for decode, filter and encode (default 1,1,1)\n"
+        << "  --queue-depth N  images held between two pipeline stages (default 2)\n"
+        << "  --cache DIR      reuse results of identical inputs and operations from DIR\n"
+        << "  --cache-size MB  keep the cache under MB megabytes (default 1024)\n"
+        << "  --cache-link     serve cache hits as hard links instead of copies\n"
+        << "  -v               report every file and a summary\n"
+        << "  --pool           reuse image buffers through a size-classed pool\n"
+        << "  --pool-prefault  like --pool, faulting new buffers in when they are mapped\n"
+        << "  --pool-idle MB   keep at most MB megabytes of idle buffers (default 1024)\n"
+        << "  --metrics FILE   write per-stage timings and counters as JSON\n"
+        << "  --metrics-prom FILE  the same in the Prometheus text format\n"
+        << "\n"
+        << "daemon:\n"
+        << "  --serve SOCKET   run jobs sent to a Unix socket until SIGTERM or a 'drain' request;\n"
+        << "                   -j sets the jobs run at once and the buffer pool is on\n"
+        << "  --submit SOCKET  send 'input output [operations]' lines from standard input to a\n"
+        << "                   daemon and print each reply: 'ok' with timings in ms, or 'error'\n"
+        << "\n"
+        << "benchmark:\n"
+        << "  --bench          time decode, every filter and encode on synthetic images\n"
+        << "  --sizes LIST     image sizes in megapixels (default 1,12,50,200)\n"
+        << "  --repeat N       runs per measurement, the fastest is reported (default 3)\n"
+        << "  --bench-dir DIR  where to put the synthetic files (default $TMPDIR or /tmp)\n"
+        << "  --bench-out FILE write the JSON report to FILE instead of standard output\n"
+        << "\n"
+        << "  --verify-fixed-point  check the fixed-point scale curves against doubles\n"
+        << "  --verify-thread-pool  check that the thread pool runs every row exactly once\n";
 }
 
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+/**
+ * Runs the non-interactive command line
+ * With more than one job running at once each file is processed on a single
+ * thread, so the cores are shared across files rather than across rows.
+ * @param argc argument count
+ * @param argv arguments
+ * @return 0 if every file was processed, 1 if any failed, 2 for usage errors
+ */
+int batch_main(int argc, char* argv[])
 {
-    int num_rows = image.size();//rows = height
-    int num_columns = image[0].size();// colums = width
-    int newred;
-    int newgreen;
-    int newblue;
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    for (int row = 0; row<num_rows; row++)
+    vector<BatchOp> ops;
+    vector<string> inputs;
+    string output_dir;
+    string manifest;
+    int jobs_at_once = 0;
+    bool stream = false;
+    OutOfCoreOptions out_of_core;
+    bool pipeline = false;
+    PipelineOptions pipeline_options;
+    int bits_per_pixel = 24;
+    bool map_output = false;
+    bool verbose = false;
+    bool have_ops = false;
+    string cache_dir;
+    double cache_megabytes = 1024;
+    bool cache_link = false;
+    bool bench = false;
+    BenchOptions bench_options;
+    MetricsOutputs metrics = metrics_from_environment();
+    configure_buffer_pool_from_environment();
+    bool pool = false;
+    bool pool_prefault = false;
+    double pool_idle_megabytes = DEFAULT_POOL_IDLE_MB;
+    string serve_socket;
+    string submit_socket;
+    string error;
+
+    for (int i = 1; i < argc; i++)
     {
-        for (int col = 0; col< num_columns; col++)
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-h" || arg == "--help")
         {
-            int blue_color = image[row][col].blue;
-            int green_color = image[row][col].green;
-            int red_color = image[row][col].red;
-            int average = (blue_color + green_color + red_color)/3;
-            
-            if (average >= 170){
-                newred= (255-(255-red_color)*scaling_factor);
-                newgreen= (255-(255-green_color)*scaling_factor);
-                newblue= (255-(255-blue_color)*scaling_factor);
+            print_usage(cout, argv[0]);
+            return 0;
+        }
+        else if (arg == "--op" && has_value)
+        {
+            if (!parse_ops(argv[++i], ops, error))
+            {
+                cerr << argv[0] << ": " << error << endl;
+                return 2;
+            }
+            have_ops = true;
+        }
+        else if (arg == "-o" && has_value)
+        {
+            output_dir = argv[++i];
+        }
+        else if (arg == "--manifest" && has_value)
+        {
+            manifest = argv[++i];
+        }
+        else if ((arg == "-j" || arg == "--threads") && has_value)
+        {
+            double count;
+            if (!parse_number(argv[++i], count) || count < 1 || count > MAX_THREADS || count != (int)count)
+            {
+                cerr << argv[0] << ": " << arg << " needs a whole number from 1 to " << MAX_THREADS << endl;
+                return 2;
             }
-            else if (average < 90){
-                newred = red_color *scaling_factor;
-                newgreen = green_color*scaling_factor;
-                newblue = blue_color*scaling_factor;
+            if (arg == "-j")
+            {
+                jobs_at_once = count;
             }
-            else{
-                newred = red_color;
-                newgreen = green_color;
-                newblue = blue_color;
+            else
+            {
+                set_thread_count(count);
             }
-            new_image[row][col].blue = newblue;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].red = newred;
         }
-    }
-    return new_image;
-}
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
-{
-    //width=img.getWidth()
-    //height=img.getHeight()
-    int num_rows = image.size();//rows = height
-    int num_columns = image[0].size();// colums = width
-    
-    //newimg = image.EmptyImage(width,height)
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    // for row in range(height):
-        //for col in range(width):
-    for (int row = 0; row<num_rows; row++)
-    {
-        for (int col = 0; col< num_columns; col++)
-        {
-            int blue_color = image[row][col].blue;
-            int green_color = image[row][col].green;
-            int red_color = image[row][col].red;
-            
-            int grey = (blue_color+green_color+red_color)/3;
-            
-            new_image[row][col].blue = grey;
-            new_image[row][col].green = grey;
-            new_image[row][col].red = grey;
+        else if (arg == "--stream")
+        {
+            stream = true;
         }
-    }
-    return new_image;
-}
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
-{
-    int num_rows = image.size();//rows=height
-    int num_columns = image[0].size();
-    
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel> (num_rows));
-
-    for(int i=0;i<num_columns;i++){
-        for(int j=0;j<num_rows;j++){
-            new_image[i][j]=image[num_rows-1-j][i];
+        else if (arg == "--memory-budget" && has_value)
+        {
+            double megabytes;
+            if (!parse_number(argv[++i], megabytes) || megabytes <= 0)
+            {
+                cerr << argv[0] << ": --memory-budget needs a size in megabytes" << endl;
+                return 2;
+            }
+            out_of_core.memory_budget = megabytes * 1e6;
+            out_of_core.automatic = true;
         }
-    }
-    
-    return new_image;
-} 
-
-vector<vector<Pixel>> rotateby90(const vector<vector<Pixel>>& image){
-    int num_rows = image.size();//rows=height
-    int num_columns = image[0].size();
-    
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel> (num_rows));
-
-    for(int i=0;i<num_columns;i++){
-        for(int j=0;j<num_rows;j++){
-            new_image[i][j]=image[num_rows-1-j][i];
+        else if (arg == "--scratch-dir" && has_value)
+        {
+            out_of_core.scratch_dir = argv[++i];
+        }
+        else if (arg == "--pipeline")
+        {
+            pipeline = true;
+        }
+        else if (arg == "--stage-threads" && has_value)
+        {
+            stringstream counts(argv[++i]);
+            string count;
+            vector<int> threads;
+            double value;
+            while (getline(counts, count, ','))
+            {
+                if (!parse_number(count, value) || value < 1 || value > MAX_THREADS || value != (int)value)
+                {
+                    break;
+                }
+                threads.push_back(value);
+            }
+            if (threads.size() != 3 || !counts.eof())
+            {
+                cerr << argv[0] << ": --stage-threads needs three positive whole numbers, such as 1,2,1" << endl;
+                return 2;
+            }
+            pipeline_options.decode_threads = threads[0];
+            pipeline_options.filter_threads = threads[1];
+            pipeline_options.encode_threads = threads[2];
+            pipeline = true;
+        }
+        else if (arg == "--queue-depth" && has_value)
+        {
+            double depth;
+            if (!parse_number(argv[++i], depth) || depth < 1 || depth > 1024 || depth != (int)depth)
+            {
+                cerr << argv[0] << ": --queue-depth needs a positive whole number" << endl;
+                return 2;
+            }
+            pipeline_options.queue_depth = depth;
+            pipeline = true;
+        }
+        else if (arg == "--mmap-output")
+        {
+            map_output = true;
+        }
+        else if (arg == "--bpp" && has_value)
+        {
+            string depth = argv[++i];
+            if (depth != "24" && depth != "32" && depth != "same")
+            {
+                cerr << argv[0] << ": --bpp needs 24, 32 or same" << endl;
+                return 2;
+            }
+            bits_per_pixel = depth == "same" ? 0 : stoi(depth);
+        }
+        else if (arg == "--cache" && has_value)
+        {
+            cache_dir = argv[++i];
+        }
+        else if (arg == "--cache-size" && has_value)
+        {
+            if (!parse_number(argv[++i], cache_megabytes) || cache_megabytes < 0)
+            {
+                cerr << argv[0] << ": --cache-size needs a size in megabytes" << endl;
+                return 2;
+            }
+        }
+        else if (arg == "--cache-link")
+        {
+            cache_link = true;
+        }
+        else if (arg == "--pool" || arg == "--pool-prefault")
+        {
+            pool = true;
+            pool_prefault = pool_prefault || arg == "--pool-prefault";
+        }
+        else if (arg == "--pool-idle" && has_value)
+        {
+            if (!parse_number(argv[++i], pool_idle_megabytes) || pool_idle_megabytes < 0)
+            {
+                cerr << argv[0] << ": --pool-idle needs a size in megabytes" << endl;
+                return 2;
+            }
+            pool = true;
+        }
+        else if (arg == "--metrics" && has_value)
+        {
+            metrics.json = argv[++i];
+        }
+        else if (arg == "--metrics-prom" && has_value)
+        {
+            metrics.prometheus = argv[++i];
+        }
+        else if (arg == "--serve" && has_value)
+        {
+            serve_socket = argv[++i];
+        }
+        else if (arg == "--submit" && has_value)
+        {
+            submit_socket = argv[++i];
+        }
+        else if (arg == "--verify-fixed-point")
+        {
+            return verify_fixed_point(cout);
+        }
+        else if (arg == "--verify-thread-pool")
+        {
+            return verify_thread_pool(cout);
+        }
+        else if (arg == "--bench")
+        {
+            bench = true;
+        }
+        else if (arg == "--sizes" && has_value)
+        {
+            bench_options.megapixels.clear();
+            stringstream sizes(argv[++i]);
+            string size;
+            double megapixels;
+            while (getline(sizes, size, ','))
+            {
+                if (!parse_number(size, megapixels) || megapixels <= 0 || megapixels > 2000)
+                {
+                    cerr << argv[0] << ": bad image size '" << size << "'" << endl;
+                    return 2;
+                }
+                bench_options.megapixels.push_back(megapixels);
+            }
+        }
+        else if (arg == "--repeat" && has_value)
+        {
+            double repeat;
+            if (!parse_number(argv[++i], repeat) || repeat < 1 || repeat > MAX_BENCH_REPEAT || repeat != (int)repeat)
+            {
+                cerr << argv[0] << ": --repeat needs a whole number from 1 to " << MAX_BENCH_REPEAT << endl;
+                return 2;
+            }
+            bench_options.repeat = repeat;
+        }
+        else if (arg == "--bench-dir" && has_value)
+        {
+            bench_options.directory = argv[++i];
+        }
+        else if (arg == "--bench-out" && has_value)
+        {
+            bench_options.output = argv[++i];
+        }
+        else if (arg == "-v")
+        {
+            verbose = true;
+        }
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            cerr << argv[0] << ": unknown or incomplete option " << arg << endl;
+            print_usage(cerr, argv[0]);
+            return 2;
+        }
+        else
+        {
+            inputs.push_back(arg);
         }
     }
-    
-    return new_image;
-}
 
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number){
-    int num_rows = image.size();//rows=height
-    int num_columns = image[0].size();// colums=width
-    
-    vector<vector<Pixel>> new_image(num_columns, vector<Pixel> (num_rows));
-    
-    int angle = number*90;
-    if (angle%90!=0){
-        cout<<"Angle must be multiple of 90 degrees" << endl;
-    }
-    else if(angle%360==0){
-        new_image = image;
-    }
-    else if(angle%360==90){
-        new_image = rotateby90(image);
+    // Pool options on the command line replace IMGPROC_POOL and IMGPROC_POOL_IDLE_MB
+    if (pool)
+    {
+        configure_buffer_pool(true, pool_prefault, pool_idle_megabytes * 1e6);
     }
-    else if(angle%360==180){
-        new_image = rotateby90(rotateby90(image));
+    if (bench)
+    {
+        return run_benchmark(bench_options);
     }
-    else{
-         new_image= rotateby90(rotateby90(rotateby90(image)));
+    if (!submit_socket.empty())
+    {
+        return submit_jobs(submit_socket, cin, cout, cerr);
     }
-    return new_image;
-}
 
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale){
-    double num_rows = image.size();//rows=height
-    double num_columns = image[0].size();//colums=width
-    vector<vector<Pixel>> new_image(num_rows*y_scale, vector<Pixel> (num_columns*x_scale));
-    
-       for(int row=0; row<(num_rows*y_scale); row++){
-            for(int col=0; col<(num_columns*x_scale); col++){ 
-                double col_scale = col/x_scale;
-                double row_scale = row/y_scale;
-                new_image[row][col]=image[row/y_scale][col/x_scale];
+    unique_ptr<ResultCache> cache;
+    if (!cache_dir.empty())
+    {
+        cache.reset(new ResultCache(cache_dir, cache_megabytes * 1e6, cache_link));
+        if (!cache->is_usable())
+        {
+            cerr << argv[0] << ": cannot use cache " << cache_dir << ": " << strerror(errno) << endl;
+            return 2;
         }
     }
-    
-    return new_image;
-}
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image){
-    
-    int num_rows = image.size();//rows = height
-    int num_columns = image[0].size();// colums = width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    for (int row = 0; row<num_rows; row++)
+    metrics_enabled = !metrics.json.empty() || !metrics.prometheus.empty();
+
+    if (!serve_socket.empty())
     {
-        for (int col = 0; col< num_columns; col++)
+        if (!inputs.empty() || !manifest.empty())
         {
-
-            int newred, newgreen, newblue;
-            
-            int blue_color = image[row][col].blue;
-            int green_color = image[row][col].green;
-            int red_color = image[row][col].red;
-            
-            int grey = (blue_color+green_color+red_color)/3;
-            
-            if(grey >= 255/2){
-                newred = 255;
-                newgreen = 255;
-                newblue =255;
-            }
-            else{
-                newred=0;
-                newgreen=0;
-                newblue=0;
-            }    
-            
-            new_image[row][col].blue = newblue;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].red = newred;
+            cerr << argv[0] << ": --serve takes its jobs from the socket, not from files or a manifest" << endl;
+            return 2;
+        }
+        if (!pool_enabled)
+        {
+            configure_buffer_pool(true, false, pool_idle_megabytes * 1e6);
         }
+        DaemonOptions daemon;
+        daemon.default_ops = ops;
+        daemon.bits_per_pixel = bits_per_pixel;
+        daemon.map_output = map_output;
+        daemon.stream = stream;
+        daemon.out_of_core = out_of_core;
+        daemon.cache = cache.get();
+        daemon.workers = jobs_at_once > 0 ? jobs_at_once : max(1u, thread::hardware_concurrency());
+        daemon.verbose = verbose;
+        auto serve_start = chrono::steady_clock::now();
+        int status = serve_jobs(serve_socket, daemon, cerr);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - serve_start).count();
+        if (metrics_enabled && !write_metrics(metrics, seconds))
+        {
+            cerr << argv[0] << ": cannot write metrics: " << strerror(errno) << endl;
+        }
+        return status;
     }
-    return new_image;
-}
 
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor){
-    
-    int num_rows = image.size();//rows = height
-    int num_columns = image[0].size();// colums = width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    for (int row = 0; row<num_rows; row++)
+    vector<BatchJob> jobs;
+    if (!manifest.empty() && !read_manifest(manifest, ops, jobs, error))
     {
-        for (int col = 0; col< num_columns; col++)
+        cerr << argv[0] << ": " << error << endl;
+        return 2;
+    }
+    if (!inputs.empty())
+    {
+        if (output_dir.empty() || !have_ops)
         {
-
-            double newred, newgreen, newblue;
-            
-            int blue_color = image[row][col].blue;
-            int green_color = image[row][col].green;
-            int red_color = image[row][col].red;
-                            
-            newblue= (255-(255-blue_color)*scaling_factor);
-            newgreen= (255-(255-green_color)*scaling_factor);
-            newred= (255-(255-red_color)*scaling_factor);
-            
-            new_image[row][col].blue = newblue;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].red = newred;
+            cerr << argv[0] << ": files need both --op and -o" << endl;
+            return 2;
+        }
+        if (mkdir(output_dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            cerr << argv[0] << ": cannot create " << output_dir << ": " << strerror(errno) << endl;
+            return 2;
+        }
+        for (const string& input : inputs)
+        {
+            size_t slash = input.find_last_of('/');
+            jobs.push_back({input, output_dir + "/" + input.substr(slash == string::npos ? 0 : slash + 1), ops});
         }
     }
-    return new_image;
-}
+    if (jobs.empty())
+    {
+        print_usage(cerr, argv[0]);
+        return 2;
+    }
+    for (BatchJob& job : jobs)
+    {
+        job.bits_per_pixel = bits_per_pixel;
+        job.map_output = map_output;
+    }
 
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor){
-    
-    int num_rows = image.size();//rows = height
-    int num_columns = image[0].size();// colums = width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    for (int row = 0; row<num_rows; row++)
+    // Two jobs writing the same file would race, so refuse before starting
+    vector<string> outputs;
+    for (const BatchJob& job : jobs)
+    {
+        outputs.push_back(job.output);
+    }
+    sort(outputs.begin(), outputs.end());
+    for (size_t i = 1; i < outputs.size(); i++)
     {
-        for (int col = 0; col< num_columns; col++)
+        if (outputs[i] == outputs[i - 1])
         {
-
-            double newred, newgreen, newblue;
-            
-            int blue_color = image[row][col].blue;
-            int green_color = image[row][col].green;
-            int red_color = image[row][col].red;
-                            
-            newblue= (blue_color*scaling_factor);
-            newgreen= (green_color*scaling_factor);
-            newred= (red_color*scaling_factor);
-            
-            new_image[row][col].blue = newblue;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].red = newred;
+            cerr << argv[0] << ": more than one job writes " << outputs[i] << endl;
+            return 2;
         }
     }
-    return new_image;
-}
 
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image){
-    
-    int num_rows = image.size();//rows = height
-    int num_columns = image[0].size();// colums = width
-    vector<vector<Pixel>> new_image(num_rows, vector<Pixel> (num_columns));
-    
-    for (int row = 0; row<num_rows; row++)
+    if (jobs_at_once <= 0)
     {
-        for (int col = 0; col< num_columns; col++)
+        jobs_at_once = max(1u, thread::hardware_concurrency());
+    }
+    jobs_at_once = min<size_t>(jobs_at_once, jobs.size());
+
+    auto start_time = chrono::steady_clock::now();
+    atomic<int> failures{0};
+    mutex report_mutex;
+    JobReport report = [&](int i, bool success, const string& message, double seconds) {
+        lock_guard<mutex> lock(report_mutex);
+        if (!success)
+        {
+            failures++;
+            cerr << argv[0] << ": " << jobs[i].input << ": " << (message.empty() ? "failed" : message) << endl;
+        }
+        else if (verbose)
+        {
+            cerr << jobs[i].input << " -> " << jobs[i].output << " (" << seconds * 1000 << " ms)" << endl;
+        }
+    };
+    auto run_jobs = [&](int begin, int end) {
+        for (int i = begin; i < end; i++)
         {
-            int blue_color = image[row][col].blue;
-            int green_color = image[row][col].green;
-            int red_color = image[row][col].red;
+            string message;
+            auto job_start = chrono::steady_clock::now();
+            bool success = run_batch_job(jobs[i], stream, out_of_core, cache.get(), message);
+            report(i, success, message, chrono::duration<double>(chrono::steady_clock::now() - job_start).count());
+        }
+    };
 
-            double newred, newgreen, newblue, max_color;
-           if(green_color > blue_color && green_color>red_color){
-               max_color = green_color;
-           }
-           if(blue_color > green_color && blue_color>red_color){
-               max_color = blue_color;
-           } 
-            
-           if(red_color > green_color && red_color>blue_color){
-               max_color = red_color;
-           }  
-            
-   
-            
-            if(red_color + green_color + blue_color >= 550){
-                newred = 255;
-                newgreen = 255;
-                newblue = 255;
-                
-            }
-            else if(red_color + green_color + blue_color <= 150){
-                
-                newred = 0;
-                newgreen = 0;
-                newblue = 0;
-            }
-            else if(max_color == red_color){
-                
-                newred = 255;
-                newgreen = 0;
-                newblue = 0;
-            }
-            else if(max_color == green_color){
-                
-                newred = 0;
-                newgreen = 255;
-                newblue = 0;
-            }
-            else{
-                
-                newred = 0;
-                newgreen = 0;
-                newblue = 255;
-            }
-            
-            new_image[row][col].blue = newblue;
-            new_image[row][col].green = newgreen;
-            new_image[row][col].red = newred;
-            
+    if (pipeline)
+    {
+        run_batch_pipeline(jobs, stream, out_of_core, cache.get(), pipeline_options, report);
+    }
+    else if (jobs_at_once == 1)
+    {
+        run_jobs(0, jobs.size());
+    }
+    else
+    {
+        ThreadPool job_pool(jobs_at_once);
+        job_pool.parallel_for(jobs.size(), 1, run_jobs);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    if (metrics_enabled && !write_metrics(metrics, seconds))
+    {
+        cerr << argv[0] << ": cannot write metrics: " << strerror(errno) << endl;
+    }
+    if (verbose)
+    {
+        cerr << jobs.size() - failures << " of " << jobs.size() << " files processed in " << seconds << " s" << endl;
+    }
+    if (verbose && pool_enabled)
+    {
+        PoolStats stats = buffer_pool().statistics();
+        cerr << "pool: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.releases << " released, "
+             << stats.resident_bytes / 1e6 << " MB resident, " << stats.idle_bytes / 1e6 << " MB idle" << endl;
+    }
+    if (verbose && pipeline)
+    {
+        const char* const waits[PIPELINE_QUEUE_COUNT][2] = {{"decode", "filter"}, {"filter", "encode"}};
+        for (int q = 0; q < PIPELINE_QUEUE_COUNT; q++)
+        {
+            const QueueStats& queue = pipeline_queues[q];
+            cerr << "pipeline " << PIPELINE_QUEUE_NAMES[q] << " queue: mean depth "
+                 << (queue.pushes != 0 ? (double)queue.depth_total / queue.pushes : 0) << " of " << queue.capacity
+                 << ", max " << queue.max_depth << "; " << waits[q][0] << " waited " << queue.full_nanoseconds / 1e9
+                 << " s for space, " << waits[q][1] << " waited " << queue.empty_nanoseconds / 1e9 << " s for images" << endl;
         }
     }
-    return new_image;
+    if (verbose && cache)
+    {
+        CacheStats stats = cache->statistics();
+        cerr << "cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.stores << " stored, "
+             << stats.evictions << " evicted, " << stats.bytes / 1e6 << " MB in use" << endl;
+    }
+    return failures == 0 ? 0 : 1;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    if (argc > 1)
+    {
+        return batch_main(argc, argv);
+    }
+    MetricsOutputs metrics = metrics_from_environment();
+    metrics_enabled = !metrics.json.empty() || !metrics.prometheus.empty();
+    configure_buffer_pool_from_environment();
+    auto start_time = chrono::steady_clock::now();
+
     int input;
     string filename;
     string new_file;
@@ -571,7 +7853,11 @@ int main()
     cout << endl << "Image Processing Application" << endl;
     cout << "Enter input BMP filename: ";
     cin >> filename;
-    vector<vector<Pixel>> original_image = read_image(filename);
+    DecodedImageCache decoded_images;
+    shared_ptr<const Image> original_image = decoded_images.load(filename);
+    shared_ptr<const Image> pyramid_image;   // the image the pyramid was built from
+    ImagePyramid pyramid;
+    Image preview;
     do{
         
         cout << endl;
@@ -588,6 +7874,7 @@ int main()
         cout << "9) Darken"<< endl;
         cout << "10) Black, white, red, green, blue"<< endl;
         cout<< "11) Change image (current: "<< filename << ")" << endl;
+        cout << "12) Preview Clarendon, Lighten or Darken at reduced size" << endl;
         cout << endl;
         cout << "Enter menu selection (0 to quit): ";
         cin >> input;
@@ -596,7 +7883,7 @@ int main()
         if(input==11){
                 cout << "Enter input BMP filename: ";
                 cin >> filename;
-                original_image = read_image(filename);
+                original_image = decoded_images.load(filename);
                 cout<<"Successfully changed input image!"<<endl;
         }
         
@@ -610,10 +7897,10 @@ int main()
             }
             case 1:{
                 cout << "Vignette selected" << endl;
-                vector<vector<Pixel>> new_image = process_1(original_image);
+                Image new_image = process_1(*original_image);
                 cout<< "Enter output BMP filename: ";
                 cin >> new_file;
-                bool success = write_image(new_file, new_image);
+                bool success = write_bmp(new_file, new_image);
                 if(success==true){
                     cout<< "Sucessfully applied vignette!"<< endl;
                     continue;
@@ -627,12 +7914,12 @@ int main()
             case 2:{
                 double scaling_factor;
                 cout<< "Clarendon selected"<< endl;
-                vector<vector<Pixel>> new_image = process_2(original_image, scaling_factor);
                 cout<< "Enter output BMP filename: ";
                 cin >> new_file;
                 cout <<"Enter scaling factor: ";
                 cin >> scaling_factor;
-                bool success = write_image(new_file, new_image);
+                Image new_image = process_2(*original_image, scaling_factor);
+                bool success = write_bmp(new_file, new_image);
                 if (success == true){
                     cout<< "Sucessfully applied clarendon!"<< endl;
                 }
@@ -644,10 +7931,10 @@ int main()
             }
             case 3:{
                 cout<< "Grayscale selected"<< endl;
-                vector<vector<Pixel>> new_image = process_3(original_image);
+                Image new_image = process_3(*original_image);
                 cout<< "Enter output BMP filename: ";
                 cin >> new_file;
-                bool success = write_image(new_file, new_image);
+                bool success = write_bmp(new_file, new_image);
                 if(success==true){
                     cout<< "Sucessfully applied grayscale!"<< endl;
                     continue;
@@ -660,10 +7947,10 @@ int main()
             }
             case 4:{
                 cout<< "Rotate 90 degrees selected"<< endl;
-                vector<vector<Pixel>> new_image = process_4(original_image);
+                Image new_image = process_4(*original_image);
                 cout<< "Enter output BMP filename: ";
                 cin >> new_file;
-                bool success = write_image(new_file, new_image);
+                bool success = write_bmp(new_file, new_image);
                 if(success==true){
                     cout<< "Successfully applied 90 degree rotation!"<< endl;
                     continue;
@@ -681,8 +7968,8 @@ int main()
                 cin >> new_file;
                 cout <<"Enter number of 90 degree rotations: ";
                 cin >> multiple;
-                vector<vector<Pixel>> new_image = process_5(original_image,multiple);
-                bool success = write_image(new_file, new_image);
+                Image new_image = process_5(*original_image,multiple);
+                bool success = write_bmp(new_file, new_image);
                 if(success==true){
                     cout<< "Successfully applied multiple 90 degree rotations!"<< endl;
                     continue;
@@ -702,8 +7989,7 @@ int main()
                 cin >> x;
                 cout << "Enter Y scale: ";
                 cin >> y;
-                vector<vector<Pixel>> new_image = process_6(original_image, x, y);
-                bool success = write_image(new_file, new_image);
+                bool success = write_enlarged_bmp(new_file, *original_image, x, y);
                 if(success==true){
                     cout<< "Successfully enlarged!"<< endl;
                     continue;
@@ -716,10 +8002,10 @@ int main()
             }
             case 7:{
                 cout<< "High contrast selected"<< endl;
-                vector<vector<Pixel>> new_image = process_7(original_image);
+                Image new_image = process_7(*original_image);
                 cout<< "Enter output BMP filename: ";
                 cin >> new_file;
-                bool success = write_image(new_file, new_image);
+                bool success = write_bmp(new_file, new_image);
                 if(success==true){
                     cout<< "Sucessfully applied high contrast!"<< endl;
                     continue;
@@ -737,8 +8023,8 @@ int main()
                 cin >> new_file;
                 cout <<"Enter scaling factor: ";
                 cin >> scale;
-                vector<vector<Pixel>> new_image = process_8(original_image, scale);
-                bool success = write_image(new_file, new_image);
+                Image new_image = process_8(*original_image, scale);
+                bool success = write_bmp(new_file, new_image);
                 if(success==true){
                     cout<< "Sucessfully lightened!"<< endl;
                     continue;
@@ -756,8 +8042,8 @@ int main()
                 cin >> new_file;
                 cout <<"Enter scaling factor: ";
                 cin >> scale;
-                vector<vector<Pixel>> new_image = process_9(original_image,scale);
-                bool success = write_image(new_file, new_image);
+                Image new_image = process_9(*original_image,scale);
+                bool success = write_bmp(new_file, new_image);
                 if(success==true){
                     cout<< "Sucessfully darkened!"<< endl;
                     continue;
@@ -770,10 +8056,10 @@ int main()
             }
             case 10:{
                 cout<< "Black, white, red, green, blue selected"<< endl;
-                vector<vector<Pixel>> new_image = process_10(original_image);
+                Image new_image = process_10(*original_image);
                 cout<< "Enter output BMP filename: ";
                 cin >> new_file;
-                bool success = write_image(new_file, new_image);
+                bool success = write_bmp(new_file, new_image);
                 if(success==true){
                     cout << "Successfully applied black, white, red, green, blue filter!"<<endl;
                     continue;
@@ -787,8 +8073,76 @@ int main()
             case 11:{
                 break;
             }
+            case 12:{
+                int filter=0, preview_width=0, preview_height=0;
+                string preview_file, answer;
+                cout << "Preview selected" << endl;
+                cout << "Enter filter to tune (2 Clarendon, 8 Lighten, 9 Darken): ";
+                cin >> filter;
+                if(filter!=2 && filter!=8 && filter!=9){
+                    cout << "Only Clarendon, Lighten and Darken can be previewed." << endl;
+                    continue;
+                }
+                cout << "Enter preview width and height in pixels: ";
+                cin >> preview_width >> preview_height;
+                cout << "Enter preview BMP filename: ";
+                cin >> preview_file;
+
+                // The pyramid is built once per loaded image and kept for later previews
+                if(pyramid_image!=original_image){
+                    if(!build_pyramid(*original_image, pyramid)){
+                        cout << "Could not build preview levels." << endl;
+                        continue;
+                    }
+                    pyramid_image = original_image;
+                }
+                const Image& level = preview_level(*original_image, pyramid, preview_width, preview_height);
+
+                double scale=0;
+                bool previewed=false;
+                while(cin){
+                    cout << "Enter scaling factor to preview, c to commit or q to cancel: ";
+                    cin >> answer;
+                    if(!cin || answer=="q"){
+                        break;
+                    }
+                    if(answer=="c"){
+                        if(!previewed){
+                            cout << "Preview a scaling factor first." << endl;
+                            continue;
+                        }
+                        cout<< "Enter output BMP filename: ";
+                        cin >> new_file;
+                        Image new_image = filter==2 ? process_2(*original_image, scale)
+                                        : filter==8 ? process_8(*original_image, scale)
+                                                    : process_9(*original_image, scale);
+                        if(write_bmp(new_file, new_image)){
+                            cout << "Successfully applied scaling factor " << scale << " at full size!" << endl;
+                        }
+                        else{
+                            cout <<"Could not write image to new file." << endl;
+                        }
+                        break;
+                    }
+                    if(!parse_number(answer, scale)){
+                        cout << "Please enter a number, c or q." << endl;
+                        continue;
+                    }
+                    auto preview_start = chrono::steady_clock::now();
+                    previewed = render_preview(level, {filter, scale}, preview) && write_bmp(preview_file, preview);
+                    double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - preview_start).count();
+                    if(previewed){
+                        cout << "Preview " << preview.width << "x" << preview.height << " written to " << preview_file
+                             << " in " << milliseconds << " ms" << endl;
+                    }
+                    else{
+                        cout << "Could not write preview to " << preview_file << "." << endl;
+                    }
+                }
+                continue;
+            }
             default:{
-                cout << "Input invalid, please enter a number 0-11."<<endl;
+                cout << "Input invalid, please enter a number 0-12."<<endl;
                 continue;
                 //quit=false;
             }
@@ -797,5 +8151,8 @@ int main()
     }
     while(input&&!quit);
 
+    if (metrics_enabled){
+        write_metrics(metrics, chrono::duration<double>(chrono::steady_clock::now() - start_time).count());
+    }
     return 0;
 }
\ No newline at end of file